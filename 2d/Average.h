@@ -0,0 +1,70 @@
+#ifndef __Average_h__
+#define __Average_h__ 1
+
+// Time-weighted running mean and variance of n quantities, updated with the
+// weighted incremental algorithm of West, Comm. ACM 22, 532 (1979).
+class RunningAverage {
+  unsigned n;
+  Real W; // Total weight (elapsed time)
+  Array1<Real>::opt Mean,M2;
+public:
+  RunningAverage() : n(0), W(0.0) {}
+
+  void Allocate(unsigned n0) {
+    n=n0;
+    W=0.0;
+    ::Allocate(Mean,n);
+    ::Allocate(M2,n);
+    Mean=0.0;
+    M2=0.0;
+  }
+
+  unsigned size() {return n;}
+  Real weight() {return W;}
+
+  void Accumulate(const Real *x, Real w) {
+    if(w <= 0.0) return;
+    W += w;
+    Real f=w/W;
+#pragma omp parallel for num_threads(threads)
+    for(unsigned i=0; i < n; ++i) {
+      Real delta=x[i]-Mean[i];
+      Mean[i] += f*delta;
+      M2[i] += w*delta*(x[i]-Mean[i]);
+    }
+  }
+
+  Real mean(unsigned i) {return Mean[i];}
+  Real variance(unsigned i) {return W > 0.0 ? M2[i]/W : 0.0;}
+
+  // Write the means and variances of quantities [start,start+count).
+  void Write(oxstream& fout, unsigned start, unsigned count) {
+    fout << count;
+    for(unsigned i=start; i < start+count; ++i)
+      fout << Mean[i];
+    fout << count;
+    for(unsigned i=start; i < start+count; ++i)
+      fout << variance(i);
+  }
+
+  // Restore quantities [start,start+count) written by Write, given the
+  // total weight W0.
+  bool Read(ixstream& fin, unsigned start, unsigned count, Real W0) {
+    W=W0;
+    unsigned m;
+    fin >> m;
+    if(m != count) return false;
+    for(unsigned i=start; i < start+count; ++i)
+      fin >> Mean[i];
+    fin >> m;
+    if(m != count) return false;
+    for(unsigned i=start; i < start+count; ++i) {
+      Real v;
+      fin >> v;
+      M2[i]=v*W;
+    }
+    return !fin.fail();
+  }
+};
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef __Image_h__
+#define __Image_h__ 1
+
+#include <pthread.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// In-situ images of the vorticity. The solver hands a downsampled frame to
+// a background thread, which maps it onto a blue-white-red palette and
+// writes it as a binary PPM or (with zlib) PNG file. A new frame waits
+// only if the previous one is still being written. A file that cannot be
+// written is reported by the next call to Post, or on destruction.
+class ImageWriter {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool pending,done;
+
+  array2<float> frame; // Owned by the writer thread while pending
+  std::string name;
+  unsigned format; // 1=PPM, 2=PNG
+  float range; // Vorticity mapped to full saturation (0=autoscale)
+  unsigned char *rgb;
+  std::string failed; // Last file that could not be written
+
+  static void *Run(void *p) {
+    ((ImageWriter *) p)->Loop();
+    return NULL;
+  }
+
+  void Loop() {
+    pthread_mutex_lock(&lock);
+    for(;;) {
+      while(!pending && !done)
+        pthread_cond_wait(&cond,&lock);
+      if(!pending) break;
+      pthread_mutex_unlock(&lock);
+      bool written=Write();
+      pthread_mutex_lock(&lock);
+      if(!written) failed=name;
+      pending=false;
+      pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  void Colormap() {
+    unsigned n=frame.Size();
+    float *f=frame();
+    float scale=range;
+    if(scale == 0.0) {
+      for(unsigned i=0; i < n; ++i) {
+        float a=fabs(f[i]);
+        if(a > scale) scale=a;
+      }
+    }
+    scale=scale > 0.0 ? 1.0/scale : 0.0;
+
+    // The rows of an image run from top (maximum y) to bottom.
+    unsigned nx=frame.Nx();
+    unsigned ny=frame.Ny();
+    unsigned char *p=rgb;
+    for(int j=ny-1; j >= 0; --j) {
+      for(unsigned i=0; i < nx; ++i) {
+        float v=f[i*ny+j]*scale;
+        if(v > 1.0) v=1.0;
+        if(v < -1.0) v=-1.0;
+        unsigned char c=(unsigned char) (255.0*(1.0-fabs(v))+0.5);
+        *(p++)=v < 0.0 ? c : 255;
+        *(p++)=c;
+        *(p++)=v > 0.0 ? c : 255;
+      }
+    }
+  }
+
+  bool Write() {
+    Colormap();
+    FILE *fout=fopen(name.c_str(),"wb");
+    if(!fout) return false;
+    unsigned nx=frame.Nx();
+    unsigned ny=frame.Ny();
+    bool written=true;
+#ifdef HAVE_ZLIB
+    if(format > 1) written=WritePNG(fout,nx,ny);
+    else
+#endif
+    {
+      fprintf(fout,"P6\n%u %u\n255\n",nx,ny);
+      fwrite(rgb,1,3*nx*ny,fout);
+    }
+    bool error=ferror(fout) || !written;
+    return fclose(fout) == 0 && !error;
+  }
+
+#ifdef HAVE_ZLIB
+  static void Put32(unsigned char *p, unsigned long x) {
+    p[0]=x >> 24;
+    p[1]=x >> 16;
+    p[2]=x >> 8;
+    p[3]=x;
+  }
+
+  static void Chunk(FILE *fout, const char *type, const unsigned char *data,
+                    unsigned long length) {
+    unsigned char buf[4];
+    Put32(buf,length);
+    fwrite(buf,1,4,fout);
+    fwrite(type,1,4,fout);
+    if(length) fwrite(data,1,length,fout);
+    unsigned long crc=crc32(0L,(const Bytef *) type,4);
+    if(length) crc=crc32(crc,data,length);
+    Put32(buf,crc);
+    fwrite(buf,1,4,fout);
+  }
+
+  // 8-bit RGB, no interlacing; each row is stored unfiltered. Return false
+  // if the image data cannot be compressed.
+  bool WritePNG(FILE *fout, unsigned nx, unsigned ny) {
+    static const unsigned char signature[]={137,'P','N','G','\r','\n',26,
+                                            '\n'};
+    fwrite(signature,1,8,fout);
+
+    unsigned char header[13];
+    Put32(header,nx);
+    Put32(header+4,ny);
+    header[8]=8;
+    header[9]=2;
+    header[10]=header[11]=header[12]=0;
+    Chunk(fout,"IHDR",header,13);
+
+    unsigned long rowsize=3*nx;
+    unsigned long rawsize=(rowsize+1)*ny;
+    unsigned char *raw=new unsigned char[rawsize];
+    for(unsigned j=0; j < ny; ++j) {
+      unsigned char *row=raw+j*(rowsize+1);
+      row[0]=0;
+      memcpy(row+1,rgb+j*rowsize,rowsize);
+    }
+    uLongf size=compressBound(rawsize);
+    unsigned char *data=new unsigned char[size];
+    bool compressed=compress2(data,&size,raw,rawsize,6) == Z_OK;
+    if(compressed) {
+      Chunk(fout,"IDAT",data,size);
+      Chunk(fout,"IEND",NULL,0);
+    }
+    delete[] data;
+    delete[] raw;
+    return compressed;
+  }
+#endif
+
+public:
+  ImageWriter(unsigned nx, unsigned ny, unsigned format, float range) :
+    pending(false), done(false), format(format), range(range) {
+    frame.Allocate(nx,ny);
+    rgb=new unsigned char[3*nx*ny];
+    pthread_mutex_init(&lock,NULL);
+    pthread_cond_init(&cond,NULL);
+    pthread_create(&thread,NULL,Run,this);
+  }
+
+  ~ImageWriter() {
+    pthread_mutex_lock(&lock);
+    done=true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread,NULL);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+    delete[] rgb;
+    if(!failed.empty())
+      msg(WARNING,"Cannot write to file %s",failed.c_str());
+  }
+
+  const char *Extension() {
+#ifdef HAVE_ZLIB
+    if(format > 1) return ".png";
+#endif
+    return ".ppm";
+  }
+
+  // Queue every stride-th point of src for writing to file name.
+  void Post(const array2<float>& src, unsigned stride,
+            const std::string& filename) {
+    pthread_mutex_lock(&lock);
+    while(pending)
+      pthread_cond_wait(&cond,&lock);
+    if(!failed.empty()) {
+      pthread_mutex_unlock(&lock);
+      msg(ERROR,"Cannot write to file %s",failed.c_str());
+      return;
+    }
+    unsigned nx=frame.Nx();
+    unsigned ny=frame.Ny();
+    for(unsigned i=0; i < nx; ++i) {
+      const float *srci=src[i*stride];
+      float *framei=frame[i];
+      for(unsigned j=0; j < ny; ++j)
+        framei[j]=srci[j*stride];
+    }
+    name=filename;
+    pending=true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+};
+
+#endif
@@ -1,14 +1,48 @@
 #ifndef __InitialCondition_h__
 #define __InitialCondition_h__ 1
 
+#include "rng.h"
+
 #define INITIALCONDITION(key) \
 {(void) new Entry<key,InitialConditionBase>(#key,InitialConditionTable);}
 
+// Counter of mode (i,j), independent of the grid size.
+inline uint64_t ModeCounter(int i, int j)
+{
+  return ((uint64_t) (uint32_t) i << 32) | (uint32_t) j;
+}
+
 class InitialConditionBase {
  public:	
   virtual ~InitialConditionBase() {};
   virtual const char *Name() {return "None";}
-  virtual Var Value(Real kx, Real ky) {return 0;}
+
+  // Set modes i in (-mx,mx), j in [0,my) (j > 0 for i <= 0) of w to the
+  // initial condition at wavenumber (d*i,d*j), using rng for random phases.
+  virtual void Fill(const Array::Array2<Var>& w, int mx, int my,
+                    const CounterRNG& rng, unsigned threads, Real d=1.0) {
+    for(int i=-mx+1; i < mx; ++i)
+      for(int j=i <= 0 ? 1 : 0; j < my; ++j)
+        w[i][j]=0.0;
+  }
+};
+
+// An initial condition with an inline kernel T::Value(kx,ky,u), where u is
+// a uniform deviate drawn for the mode. The kernel is bound statically, so
+// Fill costs one virtual call per field and the modes fill in parallel.
+template<class T>
+class InitialConditionKernel : public InitialConditionBase {
+ public:
+  void Fill(const Array::Array2<Var>& w, int mx, int my,
+            const CounterRNG& rng, unsigned threads, Real d=1.0) {
+    T *ic=static_cast<T *>(this);
+#pragma omp parallel for num_threads(threads)
+    for(int i=-mx+1; i < mx; ++i) {
+      typename Array::Array1<Var>::opt wi=w[i];
+      for(int j=i <= 0 ? 1 : 0; j < my; ++j)
+        wi[j]=ic->Value(d*i,d*j,rng.uniform(ModeCounter(i,j)));
+    }
+  }
 };
 
 extern InitialConditionBase *InitialCondition;
@@ -0,0 +1,101 @@
+#ifndef __LowStorage_h__
+#define __LowStorage_h__ 1
+
+// Low-storage (2N) Runge-Kutta integrators of Williamson, J. Comp. Phys. 35,
+// 48 (1980) and Carpenter & Kennedy, NASA TM-109112 (1994).
+//
+// Besides the solution y, only one increment register dy is carried
+// between stages:
+//
+//   dy=A[s]*dy+dt*Source(y,t+C[s]*dt);
+//   y += B[s]*dy;
+//
+// The time-integrated shell diagnostics are part of y and are advanced by
+// the same update, so they receive the quadrature weights of the scheme.
+// There is no embedded error estimate, so dynamic timestepping is rejected:
+// use a fixed timestep or cfl.
+
+class LSRK : public IntegratorBase {
+protected:
+  unsigned nstages;
+  const Real *A,*B,*C;
+  vector dy;
+public:
+  LSRK(unsigned nstages, const Real *A, const Real *B, const Real *C) :
+    nstages(nstages), A(A), B(B), C(C) {}
+
+  void Allocate() {
+    if(::dynamic)
+      msg(ERROR,"%s has no error estimate; set dynamic=0",Name());
+    IntegratorBase::Allocate();
+    ::Allocate(dy,ny);
+  }
+
+  Solve_RC Solve() {
+    Source(Src,Y,t);
+#pragma omp parallel for num_threads(threads)
+    for(unsigned j=0; j < ny; ++j) {
+      Var dyj=dt*source[j];
+      dy[j]=dyj;
+      y[j] += B[0]*dyj;
+    }
+
+    for(unsigned s=1; s < nstages; ++s) {
+      Source(Src,Y,t+C[s]*dt);
+      Real a=A[s];
+      Real b=B[s];
+#pragma omp parallel for num_threads(threads)
+      for(unsigned j=0; j < ny; ++j) {
+        Var dyj=a*dy[j]+dt*source[j];
+        dy[j]=dyj;
+        y[j] += b*dyj;
+      }
+    }
+    return SUCCESSFUL;
+  }
+};
+
+const Real LSRK3A[]={0.0,-5.0/9.0,-153.0/128.0};
+const Real LSRK3B[]={1.0/3.0,15.0/16.0,8.0/15.0};
+const Real LSRK3C[]={0.0,1.0/3.0,3.0/4.0};
+
+class LSRK3 : public LSRK {
+public:
+  const char *Name() {
+    return "Third-Order Low-Storage Runge-Kutta (Williamson)";
+  }
+  LSRK3() : LSRK(3,LSRK3A,LSRK3B,LSRK3C) {}
+};
+
+const Real LSRK4A[]={0.0,
+                     -567301805773.0/1357537059087.0,
+                     -2404267990393.0/2016746695238.0,
+                     -3550918686646.0/2091501179385.0,
+                     -1275806237668.0/842570457699.0};
+const Real LSRK4B[]={1432997174477.0/9575080441755.0,
+                     5161836677717.0/13612068292357.0,
+                     1720146321549.0/2090206949498.0,
+                     3134564353537.0/4481467310338.0,
+                     2277821191437.0/14882151754819.0};
+const Real LSRK4C[]={0.0,
+                     1432997174477.0/9575080441755.0,
+                     2526269341429.0/6820363962896.0,
+                     2006345519317.0/3224310063776.0,
+                     2802321613138.0/2924317926251.0};
+
+class LSRK4 : public LSRK {
+public:
+  const char *Name() {
+    return "Fourth-Order Low-Storage Runge-Kutta (Carpenter-Kennedy)";
+  }
+  LSRK4() : LSRK(5,LSRK4A,LSRK4B,LSRK4C) {}
+};
+
+template<class T>
+void LowStorageIntegrators(Table<IntegratorBase> *IntegratorTable, T *)
+{
+  INTEGRATOR(LSRK3);
+  INTEGRATOR(LSRK4);
+}
+
+#endif
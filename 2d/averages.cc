@@ -0,0 +1,275 @@
+// Time averages of the shell-resolved spectra and transfers written by dns.
+//
+// This is a compiled replacement for getintegrals in averages.asy: the
+// per-output files under ekvk/ and transfer/ are streamed in parallel and
+// the time-averaged rates, their standard errors, and the cumulative
+// fluxes are written once to run/averages for plotting. For a run with
+// spectrum=2, whose ekvk files hold samples of E(k) rather than its time
+// integral, Ek is averaged from the samples by the trapezoidal rule.
+//
+// Usage: averages run T [Tmax [rezero]]
+//
+// The output (xdr, in the format of out_curve) contains t0, t1, kb, kc,
+// Ek and its error, then TE, TZ, eps, eta, zeta, DE, DZ each followed by
+// its error, and finally PiE, PiZ and eta, which are defined on kb.
+
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "xstream.h"
+#include "shells.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+using namespace xdr;
+
+typedef vector<double> curve;
+
+// Transfer components, in file order
+enum {TE,TZ,EPS,ETA,ZETA,DE,DZ,NTRANSFER};
+const char *names[]={"TE","TZ","eps","eta","zeta","DE","DZ"};
+
+string run;
+unsigned rezero=0;
+curve t;
+
+string filename(const char *dir, unsigned n)
+{
+  ostringstream buf;
+  buf << run << "/" << dir << "/t" << n;
+  return buf.str();
+}
+
+// Read the time and the ncurves arrays of a file written by out_curve,
+// concatenated into y.
+bool read(const string& name, unsigned ncurves, double& time, curve& y)
+{
+  ixstream in(name.c_str());
+  if(!in) return false;
+  int n;
+  in >> n >> time;
+  y.clear();
+  for(unsigned c=0; c < ncurves; ++c) {
+    in >> n;
+    for(int K=0; K < n; ++K) {
+      double v;
+      in >> v;
+      y.push_back(v);
+    }
+  }
+  return !in.fail();
+}
+
+// The solver rezeroes the accumulated integrals after writing output n.
+inline bool reset(unsigned n)
+{
+  return rezero > 0 && n % rezero == 0;
+}
+
+// The spectrum mode of the run; runs that predate the spectrum file
+// integrated E(k).
+unsigned spectrummode()
+{
+  ifstream in((run+"/spectrum").c_str());
+  unsigned mode;
+  return in >> mode ? mode : 1;
+}
+
+// Compute the time-averaged rates of change of the integrals in dir over
+// outputs [n0,n1], and the standard error from the spread of the rates
+// over successive output intervals. If sampled, dir instead holds samples
+// of the curves, and the mean of each interval replaces its rate.
+void average(const char *dir, unsigned ncurves, unsigned n0, unsigned n1,
+             curve& mean, curve& error, bool sampled=false)
+{
+  double t0,t1;
+  curve y;
+  if(!read(filename(dir,n1),ncurves,t1,y)) {
+    cerr << "Cannot read " << filename(dir,n1) << endl;
+    exit(1);
+  }
+  size_t size=y.size();
+  curve sum(size,0.0), sum2(size,0.0);
+  bool fail=false;
+
+#pragma omp parallel
+  {
+    unsigned nthreads=1, thread=0;
+#ifdef _OPENMP
+    nthreads=omp_get_num_threads();
+    thread=omp_get_thread_num();
+#endif
+    // Each thread streams a contiguous block of intervals [n,n+1].
+    unsigned nintervals=n1-n0;
+    unsigned start=n0+nintervals*thread/nthreads;
+    unsigned stop=n0+nintervals*(thread+1)/nthreads;
+    curve s(size,0.0), s2(size,0.0), prev, next;
+    double tprev,tnext;
+    bool ok=start == stop || read(filename(dir,start),ncurves,tprev,prev);
+    for(unsigned n=start; ok && n < stop; ++n) {
+      if(!read(filename(dir,n+1),ncurves,tnext,next) || next.size() != size) {
+        ok=false;
+        break;
+      }
+      double dt=tnext-tprev;
+      if(sampled) {
+        for(size_t K=0; K < size; ++K) {
+          double a=0.5*(prev[K]+next[K]);
+          s[K] += a*dt;
+          s2[K] += a*a*dt;
+        }
+      } else {
+        bool zero=reset(n);
+        for(size_t K=0; K < size; ++K) {
+          double delta=zero ? next[K] : next[K]-prev[K];
+          s[K] += delta;
+          if(dt > 0.0) s2[K] += delta*delta/dt;
+        }
+      }
+      prev.swap(next);
+      tprev=tnext;
+    }
+#pragma omp critical
+    {
+      if(!ok) fail=true;
+      for(size_t K=0; K < size; ++K) {
+        sum[K] += s[K];
+        sum2[K] += s2[K];
+      }
+    }
+  }
+
+  if(fail) {
+    cerr << "Cannot read " << dir << " data in range" << endl;
+    exit(1);
+  }
+
+  curve y0;
+  read(filename(dir,n0),ncurves,t0,y0);
+
+  double T=t1-t0;
+  unsigned N=n1-n0;
+  mean.resize(size);
+  error.resize(size);
+  for(size_t K=0; K < size; ++K) {
+    double m=sum[K]/T;
+    double var=sum2[K]/T-m*m;
+    mean[K]=m;
+    error[K]=N > 1 && var > 0.0 ? sqrt(var/(N-1)) : 0.0;
+  }
+}
+
+void out(oxstream& fout, const double *a, size_t n)
+{
+  fout << (int) n;
+  for(size_t i=0; i < n; ++i)
+    fout << a[i];
+}
+
+void out(oxstream& fout, double a)
+{
+  out(fout,&a,1);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 3) {
+    cerr << "Usage: " << argv[0] << " run T [Tmax [rezero]]" << endl;
+    return 1;
+  }
+
+  run=argv[1];
+  double T=atof(argv[2]);
+  double Tmax=argc > 3 ? atof(argv[3]) : HUGE_VAL;
+  if(argc > 4) rezero=atoi(argv[4]);
+
+  ifstream ftin((run+"/t").c_str());
+  double t0;
+  while(ftin >> t0, ftin.good()) t.push_back(t0);
+  if(t.size() < 2) {
+    cerr << "not enough temporal data" << endl;
+    return 1;
+  }
+
+  unsigned n0=0;
+  while(n0 < t.size()-1 && t[n0] < T) ++n0;
+  unsigned n1=t.size()-1;
+  while(n1 > n0 && t[n1] > Tmax) --n1;
+  if(n1 == n0) {
+    cerr << "T=" << T << " is too large for data range" << endl;
+    return 1;
+  }
+  cout << "Averaging from T=" << t[n0] << " to " << t[n1] << endl;
+
+  curve Ek,Ekerror;
+  average("ekvk",1,n0,n1,Ek,Ekerror,spectrummode() > 1);
+  unsigned nshells=Ek.size();
+  for(unsigned K=0; K < nshells; ++K) {
+    Ek[K] *= 0.5;
+    Ekerror[K] *= 0.5;
+  }
+
+  curve Tk,Tkerror;
+  average("transfer",NTRANSFER,n0,n1,Tk,Tkerror);
+  if(Tk.size() != NTRANSFER*nshells) {
+    cerr << "Inconsistent number of shells" << endl;
+    return 1;
+  }
+  const double *te=&Tk[TE*nshells];
+  const double *tz=&Tk[TZ*nshells];
+  const double *eta=&Tk[ETA*nshells];
+  const double *dz=&Tk[DZ*nshells];
+
+  // Cumulative fluxes through kb, with the factor of 2 for the conjugate
+  // modes, as in transfer.asy.
+  curve PiE(nshells+1,0.0), PiZ(nshells+1,0.0), Eta(nshells+1,0.0);
+  for(unsigned K=0; K < nshells; ++K) {
+    PiE[K+1]=PiE[K]-2.0*te[K];
+    PiZ[K+1]=PiZ[K]-2.0*tz[K];
+  }
+  for(unsigned K=nshells; K-- > 0;)
+    Eta[K]=Eta[K+1]+2.0*(dz[K]-eta[K]);
+
+  double injection=0.0, dissipation=0.0;
+  for(unsigned K=0; K < nshells; ++K) {
+    injection += 2.0*eta[K];
+    dissipation += 2.0*dz[K];
+  }
+  cout << "  Enstrophy injection rate=" << injection << endl;
+  cout << "Enstrophy dissipation rate=" << dissipation << endl;
+
+  curve k(nshells+1);
+  for(unsigned K=0; K <= nshells; ++K) k[K]=kb(K);
+  curve c(nshells);
+  for(unsigned K=0; K < nshells; ++K) c[K]=kc(K);
+
+  oxstream fout((run+"/averages").c_str());
+  out(fout,t[n0]);
+  out(fout,t[n1]);
+  out(fout,&k[0],nshells+1);
+  out(fout,&c[0],nshells);
+  out(fout,&Ek[0],nshells);
+  out(fout,&Ekerror[0],nshells);
+  for(unsigned i=0; i < NTRANSFER; ++i) {
+    out(fout,&Tk[i*nshells],nshells);
+    out(fout,&Tkerror[i*nshells],nshells);
+  }
+  out(fout,&PiE[0],nshells+1);
+  out(fout,&PiZ[0],nshells+1);
+  out(fout,&Eta[0],nshells+1);
+  fout.close();
+  if(!fout) {
+    cerr << "Cannot write to file averages" << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -30,14 +30,41 @@ Complex forces[Nforce];
 int kxforces[Nforce];
 int kyforces[Nforce];
 Real deltaf=1.0;
+unsigned scalars=0;
+const int Nscalar=8;
+Real kappa[Nscalar];
+Real scalareta[Nscalar];
 unsigned movie=0;
+unsigned capture=0;
+unsigned wisdom=1;
+unsigned images=0;
+unsigned imagestride=1;
+Real imagerange=0.0;
+unsigned ensemble=1;
+unsigned physical=0;
+unsigned pdfbins=0;
+Real pdfrange=5.0;
+Real cfl=0.0;
+unsigned angles=0;
+unsigned coarse=0;
+unsigned bands=0;
+unsigned bandskip=1;
+unsigned averaging=0;
+Real avgstart=0.0;
+Real avgstop=REAL_MAX;
 unsigned rezero=0;
 unsigned spectrum=1;
 unsigned modalenergies=0;
+unsigned probes=0;
+const int Nprobe=64;
+int kxprobes[Nprobe];
+int kyprobes[Nprobe];
+unsigned probebuffer=4096;
 Real icalpha=1.0;
 Real icbeta=1.0;
 Real k0=1.0; // Obsolete
 int randomIC=0;
+unsigned seed=0;
 
 class DNS : public DNSBase, public ProblemBase {
 public:
@@ -67,8 +94,65 @@ public:
 
   void Stochastic(const vector2&Y, double t, double dt) {
     DNSBase::Stochastic(Y,t,dt);
+    if(spectrum) Fold(Y);
+    if(cfl) CFL();
+    if(probes) Probe(Y,t);
   }
 
+  vector totals; // Compensated shell integrals
+  vector ek; // Instantaneous energy spectrum (spectrum=2)
+
+  // Scalar variance spectra and budgets
+  vector variance;
+  Array1<Real>::opt scalarcurve;
+  oxstream fscalars;
+
+  void OutScalarCurve(const vector& v, unsigned s, const char *name);
+  void OutScalars();
+
+  void ShellTotals();
+  void ClearTotals();
+
+  void CFL();
+
+  // Amplitudes of the probed modes of the first ensemble member
+  ProbeBuffer probe;
+  oxstream fprobe;
+
+  void Probe(const vector2& Y, double t);
+
+  // Anisotropic spectra E(k,theta) and coarse-grained E(kx,ky)
+  array2<Real> Ekt,Ekxy;
+  oxstream fekt,fekxy;
+
+  void AnisotropicSpectra();
+
+  // Shell-to-band transfer T(K,Q)
+  Complex *bandblock;
+  Array2<Complex> *Band; // u, v, then the gradient (x,y) of each band
+  Complex **Fband;
+  fftwpp::ImplicitHConvolution2 *BandConvolution;
+  unsigned *bandof; // Band of each shell
+  Array1<Real>::opt bandedge;
+  array2<Real> TbandZ,TbandE;
+  oxstream fbands;
+
+  void BandTransfer();
+  void OutBandTransfer();
+
+  // Running time averages of the shell rates and of the modal energies
+  RunningAverage shellavg,modeavg;
+  rVector shelllast,shellrate,modal;
+  Real tlast,tmodal; // Time of the last sample
+  bool havelast;
+  Real tavg0,tavg1; // Averaging window covered so far
+  oxstream fmean;
+
+  void ShellValues(const rVector& y);
+  void Average(bool rezeroing);
+  void OutAverages(bool final);
+  void ReadAverages();
+
   void Initialize();
 };
 
@@ -89,57 +173,124 @@ public:
 
 DNS *DNSProblem;
 
+void multcapture2(double **F, unsigned int m,
+                  const unsigned int indexsize,
+                  const unsigned int *index,
+                  unsigned int r, unsigned int threads)
+{
+  DNSProblem->PhysicalSpace(F,m,index[0],r,true);
+  multadvection2(F,m,indexsize,index,r,threads);
+}
+
+void multensemble2(double **F, unsigned int m,
+                   const unsigned int indexsize,
+                   const unsigned int *index,
+                   unsigned int r, unsigned int threads)
+{
+  bool reduce=DNSProblem->Reducing();
+  for(unsigned e=0; e < ensemble; ++e) {
+    double **Fe=F+2*e;
+    if(reduce) DNSProblem->Reduce(Fe,m,index[0],r,false);
+    multadvection2(Fe,m,indexsize,index,r,threads);
+  }
+}
+
+// (u,v,w_x^1,w_y^1,...,w_x^Q,w_y^Q) -> (u.grad w^1,...,u.grad w^Q)
+void multbands2(double **F, unsigned int m,
+                const unsigned int indexsize,
+                const unsigned int *index,
+                unsigned int r, unsigned int threads)
+{
+  double *u=F[0];
+  double *v=F[1];
+  // Output q overwrites an input of band (q-2)/2 < q, already consumed.
+  for(unsigned j=0; j < m; ++j) {
+    double uj=u[j];
+    double vj=v[j];
+    for(unsigned q=0; q < bands; ++q)
+      F[q][j]=uj*F[2+2*q][j]+vj*F[3+2*q][j];
+  }
+}
+
+// (u,v,theta_x^1,theta_y^1,...) -> (advection,u.grad theta^1,...)
+void multscalar2(double **F, unsigned int m,
+                 const unsigned int indexsize,
+                 const unsigned int *index,
+                 unsigned int r, unsigned int threads)
+{
+  if(DNSProblem->Reducing()) DNSProblem->Reduce(F,m,index[0],r,false);
+  double *u=F[0];
+  double *v=F[1];
+  // Output 2+s overwrites an input of scalar s/2 <= s, already consumed.
+  for(unsigned j=0; j < m; ++j) {
+    double uj=u[j];
+    double vj=v[j];
+    for(unsigned s=0; s < scalars; ++s)
+      F[2+s][j]=uj*F[2+2*s][j]+vj*F[3+2*s][j];
+  }
+  multadvection2(F,m,indexsize,index,r,threads);
+}
+
+void multphysical2(double **F, unsigned int m,
+                   const unsigned int indexsize,
+                   const unsigned int *index,
+                   unsigned int r, unsigned int threads)
+{
+  DNSProblem->PhysicalSpace(F,m,index[0],r,false);
+  multadvection2(F,m,indexsize,index,r,threads);
+}
+
 InitialConditionBase *InitialCondition;
 ForcingBase *Forcing;
 
-class Zero : public InitialConditionBase {
+class Zero : public InitialConditionKernel<Zero> {
 public:
   const char *Name() {return "Zero";}
 
-  Var Value(Real,Real) {return 0.0;}
+  Var Value(Real,Real,Real) {return 0.0;}
 };
 
-class Constant : public InitialConditionBase {
+class Constant : public InitialConditionKernel<Constant> {
 public:
   const char *Name() {return "Constant";}
 
-  Var Value(Real,Real) {return Complex(icalpha,icbeta);}
+  Var Value(Real,Real,Real) {return Complex(icalpha,icbeta);}
 };
 
-class Equipartition : public InitialConditionBase {
+class Equipartition : public InitialConditionKernel<Equipartition> {
 public:
   const char *Name() {return "Equipartition";}
 
-  Var Value(Real kx, Real ky) {
+  Var Value(Real kx, Real ky, Real u) {
     Real k2=kx*kx+ky*ky;
     Real k=sqrt(k2);
     Real v=icalpha+icbeta*k2;
     v=v ? k*sqrt(2.0/v) : 0.0;
-    return randomIC ? v*expi(twopi*drand()) : v*sqrt(0.5)*Complex(1,1);
+    return randomIC ? v*expi(twopi*u) : v*sqrt(0.5)*Complex(1,1);
   }
 };
 
-class Benchmark : public InitialConditionBase {
+class Benchmark : public InitialConditionKernel<Benchmark> {
 public:
   const char *Name() {return "Benchmark";}
 
-  Var Value(Real kx, Real ky) {
+  Var Value(Real kx, Real ky, Real u) {
     Real k2=kx*kx+ky*ky;
     Real k=sqrt(k2);
     Real v=icalpha+icbeta*k2;
     v=v ? sqrt(2.0/v) : 0.0;
-    return randomIC ? k*v*expi(twopi*drand()) : v*sqrt(0.5)*Complex(k,kx+ky);
+    return randomIC ? k*v*expi(twopi*u) : v*sqrt(0.5)*Complex(k,kx+ky);
   }
 };
 
-class Power : public InitialConditionBase {
+class Power : public InitialConditionKernel<Power> {
 public:
   const char *Name() {return "Power";}
 
-  Var Value(Real kx, Real ky) {
+  Var Value(Real kx, Real ky, Real u) {
     Real k2=kx*kx+ky*ky;
     Real v=icbeta*pow(k2,-0.5*icalpha);
-    return randomIC ? v*expi(twopi*drand()) : v;
+    return randomIC ? v*expi(twopi*u) : v;
   }
 };
 
@@ -261,9 +412,30 @@ DNSVocabulary::DNSVocabulary()
   VOCAB(Nx,1,INT_MAX,"Number of dealiased modes in x direction");
   VOCAB(Ny,1,INT_MAX,"Number of dealiased modes in y direction");
   VOCAB(movie,0,1,"Output movie? (0=no, 1=yes)");
-  VOCAB(spectrum,0,1,"Output spectrum? (0=no, 1=yes)");
+  VOCAB(capture,0,2,"Capture movie from convolution? (0=no, 1=vorticity, 2=vorticity and velocity)");
+  VOCAB(wisdom,0,2,"Reuse FFTW plans? (0=default wisdom file, 1=per size, thread count and CPU, 2=also plan patiently)");
+  VOCAB(images,0,2,"Write in-situ vorticity images? (0=no, 1=PPM, 2=PNG)");
+  VOCAB(imagestride,1,INT_MAX,"Downsampling stride of images");
+  VOCAB(imagerange,0.0,REAL_MAX,"Vorticity of full color saturation in images (0=autoscale)");
+  VOCAB(physical,0,1,"Output physical-space diagnostics? (0=no, 1=yes)");
+  VOCAB(pdfbins,0,INT_MAX,"Number of bins in velocity PDFs");
+  VOCAB(pdfrange,0.0,REAL_MAX,"Range of velocity PDFs in units of rms velocity");
+  VOCAB(cfl,0.0,REAL_MAX,"CFL number for timestep control (0=off)");
+  VOCAB(angles,0,INT_MAX,"Number of angular bins of E(k,theta) (0=off)");
+  VOCAB(coarse,0,INT_MAX,"Resolution of coarse-grained E(kx,ky) (0=off)");
+  VOCAB(bands,0,INT_MAX,"Number of logarithmic bands for shell-to-band transfer (0=off)");
+  VOCAB(bandskip,1,INT_MAX,"Compute the shell-to-band transfer every bandskip outputs");
+  VOCAB(averaging,0,2,"Accumulate running time averages? (0=no, 1=shells, 2=shells and modal energies)");
+  VOCAB(avgstart,0.0,REAL_MAX,"Start of time-averaging window");
+  VOCAB(avgstop,0.0,REAL_MAX,"End of time-averaging window");
+  VOCAB(spectrum,0,2,"Output spectrum? (0=no, 1=time-integrated, 2=instantaneous at output)");
   VOCAB(modalenergies,0,1,"Output modal energies? (0=no, 1=yes)");
-  VOCAB(rezero,0,INT_MAX,"Rezero moments every rezero output steps for high accuracy");
+  VOCAB(probes,0,Nprobe,"Number of modes (kxprobes,kyprobes) recorded every step");
+  VOCAB_ARRAY(kxprobes,"kx probe wavenumbers");
+  VOCAB_ARRAY(kyprobes,"ky probe wavenumbers");
+  VOCAB(probebuffer,1,INT_MAX,"Number of steps of probe data buffered between writes");
+  VOCAB(ensemble,1,INT_MAX,"Number of ensemble members advanced together");
+  VOCAB(rezero,0,INT_MAX,"Rezero moments every rezero output steps (unnecessary: the integrals are compensated)");
 
   METHOD(DNS);
 
@@ -271,6 +443,7 @@ DNSVocabulary::DNSVocabulary()
   VOCAB(icalpha,0.0,0.0,"initial condition parameter");
   VOCAB(icbeta,0.0,0.0,"initial condition parameter");
   VOCAB(randomIC,0,1,"randomize the initial conditions?");
+  VOCAB(seed,0,0,"random seed for the initial conditions");
   INITIALCONDITION(Zero);
   INITIALCONDITION(Constant);
   INITIALCONDITION(Equipartition);
@@ -295,6 +468,10 @@ DNSVocabulary::DNSVocabulary()
   VOCAB_ARRAY(kyforces,"ky force wavenumbers");
   VOCAB_ARRAY(forces,"force amplitudes");
   VOCAB(deltaf,0.0,REAL_MAX,"forcing band width");
+
+  VOCAB(scalars,0,Nscalar,"Number of passive scalars");
+  VOCAB_ARRAY(kappa,"scalar diffusivities");
+  VOCAB_ARRAY(scalareta,"scalar variance injection rates in the forcing band");
   FORCING(None);
   FORCING(ConstantBanded);
   FORCING(ConstantList);
@@ -308,6 +485,7 @@ DNS::DNS()
   check_compatibility(DEBUG);
   ConservativeIntegrators(DNS_Vocabulary.IntegratorTable,this);
   ExponentialIntegrators(DNS_Vocabulary.IntegratorTable,this);
+  LowStorageIntegrators(DNS_Vocabulary.IntegratorTable,this);
 }
 
 DNS::~DNS()
@@ -345,6 +523,7 @@ void DNS::InitialConditions()
   Ny=::Ny;
   nuH=::nuH;
   nuL=::nuL;
+  seed=::seed;
   kH2=kH*kH;
   kL2=kL*kL;
 
@@ -353,10 +532,25 @@ void DNS::InitialConditions()
   mx=(Nx+1)/2;
   my=(Ny+1)/2;
 
-  nshells=spectrum ? (unsigned) (hypot(mx-1,my-1)+0.5) : 0;
+  if(wisdom) {
+    ostringstream size;
+    size << Nx << "x" << Ny;
+    SetWisdom("dns",size.str(),threads);
+    if(wisdom > 1) fftw::effort=FFTW_PATIENT;
+  }
+
+  nscalars=scalars;
+  kappa=::kappa;
+  scalareta=::scalareta;
+
+  nshells=spectrum ? ::nshells(mx,my) : 0;
+  if(spectrum) shells.Allocate(mx,my);
 
   NY[PAD]=my;
-  NY[OMEGA]=Nx*my;
+  nmode=Nx*my;
+  Minv=1.0/ensemble;
+
+  NY[OMEGA]=ensemble*nmode;
   NY[TRANSFERE]=nshells;
   NY[TRANSFERZ]=nshells;
   NY[EPS]=nshells;
@@ -365,6 +559,12 @@ void DNS::InitialConditions()
   NY[DISSIPATIONE]=nshells;
   NY[DISSIPATIONZ]=nshells;
   NY[EK]=nshells;
+  NY[TRANSFERS]=nscalars*nshells;
+  NY[EPSS]=nscalars*nshells;
+  NY[DISSIPATIONS]=nscalars*nshells;
+  NY[SUM]=ntotals();
+  NY[CARRY]=ntotals();
+  NY[SCALAR]=nscalars*nmode;
 
   cout << "\nGEOMETRY: (" << Nx << " X " << Ny << ")" << endl;
   cout << "\nALLOCATING FFT BUFFERS" << endl;
@@ -380,6 +580,9 @@ void DNS::InitialConditions()
   Dimension(DE,nshells);
   Dimension(DZ,nshells);
   Dimension(E,nshells);
+  Dimension(TS,nscalars*nshells);
+  Dimension(ES,nscalars*nshells);
+  Dimension(DS,nscalars*nshells);
 
   w.Dimension(Nx,my,-mx+1,0);
   S.Dimension(Nx,my,-mx+1,0);
@@ -392,17 +595,139 @@ void DNS::InitialConditions()
   for(int j=0; j < my; ++j)
     f1(j)=f[j]=0.0;
 
+  F=new Complex*[2+2*nscalars];
   F[1]=f1;
 
-  Convolution=new fftwpp::ImplicitHConvolution2(mx,my,false,true,2,2);
+  if(nscalars) {
+    if(ensemble > 1 || (movie && capture) || images || physical)
+      msg(ERROR,"scalars are not implemented with ensemble, capture, images, or physical");
+    // The scalar gradients ride in the convolution of the velocity.
+    theta.Dimension(Nx,my,-mx+1,0);
+    unsigned A=2*nscalars;
+    unsigned n=(Nx+1)*my;
+    scalarblock=ComplexAlign(A*n);
+    Theta=new Array2<Complex>[A];
+    for(unsigned a=0; a < A; ++a) {
+      Theta[a].Dimension(Nx+1,my,scalarblock+a*n,-mx,0);
+      for(int j=0; j < my; ++j)
+        Theta[a](j)=0.0;
+      F[2+a]=Theta[a];
+    }
+  }
+
+  if(ensemble > 1) {
+    if((movie && capture) || images)
+      msg(ERROR,"capture and images are not implemented for ensemble runs");
+    unsigned n=(Nx+1)*my;
+    ensembleblock=ComplexAlign(2*ensemble*n);
+    U=new Array2<Complex>[ensemble];
+    V=new Array2<Complex>[ensemble];
+    Fensemble=new Complex*[2*ensemble];
+    for(unsigned e=0; e < ensemble; ++e) {
+      U[e].Dimension(Nx+1,my,ensembleblock+2*e*n,-mx,0);
+      V[e].Dimension(Nx+1,my,ensembleblock+(2*e+1)*n,-mx,0);
+      for(int j=0; j < my; ++j)
+        U[e](j)=V[e](j)=0.0;
+      Fensemble[2*e]=U[e];
+      Fensemble[2*e+1]=V[e];
+    }
+    EnsembleConvolution=new fftwpp::ImplicitHConvolution2(mx,my,false,true,
+                                                          2*ensemble,
+                                                          2*ensemble);
+  } else
+    Convolution=new fftwpp::ImplicitHConvolution2(mx,my,false,true,
+                                                  2+2*nscalars,2+nscalars);
 
   Allocate(count,nshells);
   setcount();
 
-  if(movie) {
+  framedue=false;
+  physicaldue=false;
+  reductions=0;
+  umaxstep=vmaxstep=0.0;
+  if(cfl) {
+    if(dynamic) msg(ERROR,"cfl and dynamic timestepping are exclusive");
+    reductions |= MAXIMA;
+  }
+  moments=new Moments[threads];
+  if(physical && pdfbins) {
+    histogram.Allocate(threads,2*pdfbins);
+    Allocate(pdf,2*pdfbins);
+  }
+
+  // Physical-space grid of the 3/2-padded convolution
+  nxp=3*mx;
+  nyp=3*my-2;
+
+  if((movie && capture) || images || (physical && ensemble == 1)) {
+    f2.Allocate(Nx+1,my,-mx,0,align);
+    for(int j=0; j < my; ++j)
+      f2(j)=0.0;
+    G[1]=f1;
+    G[2]=f2;
+    CaptureConvolution=new fftwpp::ImplicitHConvolution2(mx,my,false,true,
+                                                         3,2);
+  }
+
+  if(angles) {
+    if(!spectrum) msg(ERROR,"angles requires spectrum");
+    Ekt.Allocate(nshells,angles);
+  }
+  if(coarse) {
+    if(coarse > (unsigned) my) coarse=my;
+    Ekxy.Allocate(coarse,coarse);
+  }
+
+  if(bands) {
+    if(!spectrum) msg(ERROR,"bands requires spectrum");
+    // Band q holds the shells kb(0)*(2*kb(nshells))^(q/Q) <= k < ...
+    Allocate(bandedge,bands+1);
+    bandof=new unsigned[nshells];
+    Real ratio=2.0*kb(nshells);
+    for(unsigned q=0; q <= bands; ++q)
+      bandedge[q]=kb(0)*pow(ratio,(Real) q/bands);
+    for(unsigned K=0, q=0; K < nshells; ++K) {
+      while(q < bands-1 && kc(K) >= bandedge[q+1]) ++q;
+      bandof[K]=q;
+    }
+    TbandZ.Allocate(bands,nshells);
+    TbandE.Allocate(bands,nshells);
+
+    unsigned A=2+2*bands;
+    unsigned n=(Nx+1)*my;
+    bandblock=ComplexAlign(A*n);
+    Band=new Array2<Complex>[A];
+    Fband=new Complex*[A];
+    for(unsigned a=0; a < A; ++a) {
+      Band[a].Dimension(Nx+1,my,bandblock+a*n,-mx,0);
+      for(int j=0; j < my; ++j)
+        Band[a](j)=0.0;
+      Fband[a]=Band[a];
+    }
+    BandConvolution=new fftwpp::ImplicitHConvolution2(mx,my,false,true,A,
+                                                      bands);
+  }
+
+  if((movie && capture) || images) {
+    wframe.Allocate(nxp,nyp);
+    if(capture > 1) {
+      uframe.Allocate(nxp,nyp);
+      vframe.Allocate(nxp,nyp);
+    }
+  }
+  if(movie && !capture) {
     wr.Dimension(Nx+1,2*my,(Real *) f1());
     Backward=new fftwpp::crfft2d(Nx+1,2*my-1,f1);
   }
+  if(images) {
+#ifndef HAVE_ZLIB
+    if(images > 1)
+      msg(WARNING,"PNG images need zlib (make ZLIB=1); writing PPM images");
+#endif
+    unsigned nx=(nxp+imagestride-1)/imagestride;
+    unsigned ny=(nyp+imagestride-1)/imagestride;
+    Images=new ImageWriter(nx,ny,images,imagerange);
+  }
 
   InitialCondition=DNS_Vocabulary.NewInitialCondition(ic);
 
@@ -416,6 +741,16 @@ void DNS::InitialConditions()
   Init(DE,Y[DISSIPATIONE]);
   Init(DZ,Y[DISSIPATIONZ]);
   Init(E,Y[EK]);
+  Init(TS,Y[TRANSFERS],nscalars*nshells);
+  Init(ES,Y[EPSS],nscalars*nshells);
+  Init(DS,Y[DISSIPATIONS],nscalars*nshells);
+  ClearTotals();
+  Allocate(totals,ntotals());
+  if(spectrum > 1) Allocate(ek,nshells);
+  if(nscalars && spectrum) {
+    Allocate(variance,nscalars*nshells);
+    Allocate(scalarcurve,nshells);
+  }
 
   Forcing=DNS_Vocabulary.NewForcing(forcing);
 
@@ -429,18 +764,45 @@ void DNS::InitialConditions()
 
   open_output(ft,dirsep,"t");
   open_output(fevt,dirsep,"evt");
+  if(physical)
+    open_output(fphysical,dirsep,"physical");
 
   if(!restart) {
     remove_dir(Vocabulary->FileName(dirsep,"ekvk"));
     remove_dir(Vocabulary->FileName(dirsep,"transfer"));
+    remove_dir(Vocabulary->FileName(dirsep,"pdf"));
+    remove_dir(Vocabulary->FileName(dirsep,"bands"));
+    remove_dir(Vocabulary->FileName(dirsep,"ekt"));
+    remove_dir(Vocabulary->FileName(dirsep,"ekxy"));
+    remove_dir(Vocabulary->FileName(dirsep,"images"));
+    remove_dir(Vocabulary->FileName(dirsep,"scalars"));
   }
 
   mkdir(Vocabulary->FileName(dirsep,"ekvk"),0xFFFF);
   mkdir(Vocabulary->FileName(dirsep,"transfer"),0xFFFF);
+  if(physical && pdfbins)
+    mkdir(Vocabulary->FileName(dirsep,"pdf"),0xFFFF);
+  if(bands)
+    mkdir(Vocabulary->FileName(dirsep,"bands"),0xFFFF);
+  if(angles)
+    mkdir(Vocabulary->FileName(dirsep,"ekt"),0xFFFF);
+  if(coarse)
+    mkdir(Vocabulary->FileName(dirsep,"ekxy"),0xFFFF);
+  if(images)
+    mkdir(Vocabulary->FileName(dirsep,"images"),0xFFFF);
+  if(nscalars && spectrum)
+    mkdir(Vocabulary->FileName(dirsep,"scalars"),0xFFFF);
 
   errno=0;
 
-  DNSBase::InitialConditions();
+  for(unsigned e=0; e < ensemble; ++e) {
+    w.Set(Y[OMEGA]+e*nmode);
+    DNSBase::InitialConditions(e);
+  }
+  w.Set(Y[OMEGA]);
+  vector theta0=Y[SCALAR];
+  for(unsigned i=0; i < nscalars*nmode; ++i)
+    theta0[i]=0.0;
   DNSBase::SetParameters();
 
   open_output(fprolog,dirsep,"prolog",false);
@@ -452,33 +814,99 @@ void DNS::InitialConditions()
 
   fprolog.close();
 
+  // With spectrum=2, ekvk holds samples of E(k) rather than its integral.
+  ofstream fspectrum;
+  open_output(fspectrum,dirsep,"spectrum",false);
+  fspectrum << spectrum << endl;
+  fspectrum.close();
+
   if(modalenergies)
     open_output(fek,dirsep,"ek");
 
-  if(movie)
+  if(probes) {
+    int *k=new int[2*probes];
+    for(unsigned p=0; p < probes; ++p) {
+      int i=kxprobes[p];
+      int j=kyprobes[p];
+      if(abs(i) >= mx || abs(j) >= my || (i == 0 && j == 0))
+        msg(ERROR,"Probed modes must be nonzero and lie within the grid");
+      k[2*p]=i;
+      k[2*p+1]=j;
+    }
+    probe.Allocate(probes,1,2,k,probebuffer);
+    delete [] k;
+    open_output(fprobe,dirsep,"probe");
+  }
+
+  if(averaging) {
+    const unsigned nquantities=8; // Ek, TE, TZ, eps, eta, zeta, DE, DZ
+    shellavg.Allocate(nquantities*nshells);
+    Allocate(shelllast,nquantities*nshells);
+    Allocate(shellrate,nquantities*nshells);
+    if(averaging > 1) {
+      modeavg.Allocate(nmode);
+      Allocate(modal,nmode);
+    }
+    havelast=false;
+    tavg0=tavg1=0.0;
+    if(restart) ReadAverages();
+  }
+
+  if(movie) {
     open_output(fw,dirsep,"w");
+    if(capture > 1) {
+      open_output(fvx,dirsep,"vx");
+      open_output(fvy,dirsep,"vy");
+    }
+  }
 }
 
 void DNS::Output(int it)
 {
   vector y=Y[OMEGA];
+
+  // Ensemble-averaged invariants
+  Real E=0.0, Z=0.0, P=0.0;
+  for(unsigned e=0; e < ensemble; ++e) {
+    w.Set(y+e*nmode);
+    Real Ee,Ze,Pe;
+    ComputeInvariants(w,Ee,Ze,Pe);
+    E += Ee;
+    Z += Ze;
+    P += Pe;
+  }
+  E *= Minv;
+  Z *= Minv;
+  P *= Minv;
   w.Set(y);
 
-  Real E,Z,P;
-  ComputeInvariants(w,E,Z,P);
   fevt << t << "\t" << E << "\t" << Z << "\t" << P << endl;
 
   if(output) out_curve(fw,y,"w",NY[OMEGA]);
 
-  if(movie)
-    OutFrame(it);
+  // Captured frames and images are written by the next call to Advection.
+  if((movie && capture) || images) framedue=true;
+  if(movie && !capture) OutFrame(it);
+  imagecount=tcount;
+
+  if(physical) {
+    // Reduced in the multiply pass of the next call to Advection
+    physicaldue=true;
+    urms=sqrt(E);
+    tphysical=t;
+    pdfcount=tcount;
+  }
 
   if(modalenergies)
     OutEnergies();
 
+  if(angles || coarse)
+    AnisotropicSpectra();
+
   if(spectrum) {
     ostringstream buf;
-    Set(this->E,Y[EK]);
+    ShellTotals();
+    if(spectrum > 1) InstantaneousSpectrum(Y,ek);
     buf << "ekvk" << dirsep << "t" << tcount;
     const string& s=buf.str();
     open_output(fekvk,dirsep,s.c_str(),0);
@@ -487,13 +915,6 @@ void DNS::Output(int it)
     fekvk.close();
     if(!fekvk) msg(ERROR,"Cannot write to file ekvk");
 
-    Set(TE,Y[TRANSFERE]);
-    Set(TZ,Y[TRANSFERZ]);
-    Set(Eps,Y[EPS]);
-    Set(Eta,Y[ETA]);
-    Set(Zeta,Y[ZETA]);
-    Set(DE,Y[DISSIPATIONE]);
-    Set(DZ,Y[DISSIPATIONZ]);
     buf.str("");
     buf << "transfer" << dirsep << "t" << tcount;
     const string& S=buf.str();
@@ -508,12 +929,22 @@ void DNS::Output(int it)
     out_curve(ftransfer,cwrap::DZ,"DZ",nshells);
     ftransfer.close();
     if(!ftransfer) msg(ERROR,"Cannot write to file transfer");
+
+    if(bands && tcount % bandskip == 0) {
+      BandTransfer();
+      OutBandTransfer();
+    }
+
+    if(nscalars) OutScalars();
   }
 
+  bool rezeroing=rezero && it % rezero == 0 && spectrum;
+  if(averaging) Average(rezeroing);
+
   tcount++;
   ft << t << endl;
 
-  if(rezero && it % rezero == 0 && spectrum) {
+  if(rezeroing) {
     vector2 Y=Integrator->YVector();
 
     Init(TE,Y[TRANSFERE]);
@@ -524,11 +955,370 @@ void DNS::Output(int it)
     Init(DE,Y[DISSIPATIONE]);
     Init(DZ,Y[DISSIPATIONZ]);
     Init(this->E,Y[EK]);
+    Init(TS,Y[TRANSFERS],nscalars*nshells);
+    Init(ES,Y[EPSS],nscalars*nshells);
+    Init(DS,Y[DISSIPATIONS],nscalars*nshells);
+    ClearTotals();
   }
 }
 
+// Point the shell diagnostics at the compensated totals of the integrals.
+void DNS::ShellTotals()
+{
+  Fold(Y);
+  Var *s=Y[SUM];
+  Var *c=Y[CARRY];
+  unsigned n=ntotals();
+  for(unsigned i=0; i < n; ++i)
+    totals[i]=s[i].re+c[i].re;
+  Set(TE,totals);
+  Set(TZ,totals+nshells);
+  Set(Eps,totals+2*nshells);
+  Set(Eta,totals+3*nshells);
+  Set(Zeta,totals+4*nshells);
+  Set(DE,totals+5*nshells);
+  Set(DZ,totals+6*nshells);
+  Set(this->E,totals+7*nshells);
+  Set(TS,totals+8*nshells);
+  Set(ES,totals+(8+nscalars)*nshells);
+  Set(DS,totals+(8+2*nscalars)*nshells);
+}
+
+void DNS::ClearTotals()
+{
+  Var *s=Y[SUM];
+  Var *c=Y[CARRY];
+  unsigned n=ntotals();
+  for(unsigned i=0; i < n; ++i)
+    s[i]=c[i]=0.0;
+}
+
+void DNS::OutScalarCurve(const vector& v, unsigned s, const char *name)
+{
+  Var *vs=v+s*nshells;
+  for(unsigned K=0; K < nshells; ++K)
+    scalarcurve[K]=vs[K].re;
+  ostringstream buf;
+  buf << name << s;
+  out_curve(fscalars,(Real *) scalarcurve,buf.str().c_str(),nshells);
+}
+
+// Variance spectrum and shell budget of each scalar
+void DNS::OutScalars()
+{
+  ScalarSpectrum(Y,variance);
+  for(unsigned s=0; s < nscalars; ++s) {
+    Var *Vs=variance+s*nshells;
+    for(unsigned K=0; K < nshells; ++K)
+      Vs[K] *= count[K] > 0 ? twopi/count[K] : 0.0;
+  }
+
+  ostringstream buf;
+  buf << "scalars" << dirsep << "t" << tcount;
+  const string& name=buf.str();
+  open_output(fscalars,dirsep,name.c_str(),0);
+  out_curve(fscalars,t,"t");
+  for(unsigned s=0; s < nscalars; ++s) {
+    OutScalarCurve(variance,s,"V");
+    OutScalarCurve(TS,s,"TS");
+    OutScalarCurve(ES,s,"eps");
+    OutScalarCurve(DS,s,"DS");
+  }
+  fscalars.close();
+  if(!fscalars) msg(ERROR,"Cannot write to file scalars");
+}
+
+// Accumulate the modal energies 0.5|w|^2/k^2 of the stored half plane
+// (0 <= theta < pi; the conjugate modes are implied) into angle bins of
+// each shell and into coarse blocks of the (kx,ky) grid.
+class AnisotropicSum {
+  array2<Real>& Ekt;
+  array2<Real>& Ekxy;
+  int mx;
+  Real scale,anglescale,xscale,yscale;
+public:
+  AnisotropicSum(DNS *b, int mx, int my, Real Minv) :
+    Ekt(b->Ekt), Ekxy(b->Ekxy), mx(mx), scale(0.5*Minv),
+    anglescale(angles/M_PI), xscale((Real) coarse/(2*mx-1)),
+    yscale((Real) coarse/my) {}
+
+  inline void operator()(const Vector& wi, const Vector&, int i, int j,
+                         unsigned K) {
+    Real e=scale*abs2(wi[j])/(i*i+j*j);
+    if(angles) {
+      unsigned a=(unsigned) (atan2((Real) j,(Real) i)*anglescale);
+      Ekt(K,a < angles ? a : angles-1) += e;
+    }
+    if(coarse)
+      Ekxy((unsigned) ((i+mx-1)*xscale),(unsigned) (j*yscale)) += e;
+  }
+
+  inline void operator()(const Vector& wi, const Vector& Si, int i, int j) {
+    (*this)(wi,Si,i,j,0);
+  }
+};
+
+void DNS::AnisotropicSpectra()
+{
+  if(angles) Ekt=0.0;
+  if(coarse) Ekxy=0.0;
+  for(unsigned e=0; e < ensemble; ++e) {
+    w.Set(Y[OMEGA]+e*nmode);
+    if(angles)
+      ShellLoop(Initw(this),AnisotropicSum(this,mx,my,Minv));
+    else
+      Loop(Initw(this),AnisotropicSum(this,mx,my,Minv));
+  }
+  w.Set(Y[OMEGA]);
+
+  ostringstream buf;
+  if(angles) {
+    buf << "ekt" << dirsep << "t" << tcount;
+    open_output(fekt,dirsep,buf.str().c_str(),0);
+    out_curve(fekt,t,"t");
+    fekt << nshells << angles;
+    out_curve(fekt,(Real *) Ekt,"Ekt",nshells*angles);
+    fekt.close();
+    if(!fekt) msg(ERROR,"Cannot write to file ekt");
+  }
+  if(coarse) {
+    buf.str("");
+    buf << "ekxy" << dirsep << "t" << tcount;
+    open_output(fekxy,dirsep,buf.str().c_str(),0);
+    out_curve(fekxy,t,"t");
+    fekxy << coarse << coarse;
+    out_curve(fekxy,(Real *) Ekxy,"Ekxy",coarse*coarse);
+    fekxy.close();
+    if(!fekxy) msg(ERROR,"Cannot write to file ekxy");
+  }
+}
+
+// Shell-to-band transfer: T(K,Q) is the rate at which advection of the
+// vorticity of band Q by the full velocity feeds the enstrophy (TbandZ) or
+// energy (TbandE) of shell K; summed over Q it gives TZ and TE. All bands
+// share the velocity transforms of one batched convolution per member.
+void DNS::BandTransfer()
+{
+  TbandZ=0.0;
+  TbandE=0.0;
+  for(unsigned e=0; e < ensemble; ++e) {
+    w.Set(Y[OMEGA]+e*nmode);
+#pragma omp parallel for num_threads(threads)
+    for(int i=-mx+1; i < mx; ++i) {
+      Vector wi=w[i];
+      Velocity(wi,Band[0][i],Band[1][i],i);
+      int jstart=i <= 0 ? 1 : 0;
+      for(unsigned a=2; a < 2+2*bands; ++a) {
+        Vector gi=Band[a][i];
+        for(int j=jstart; j < my; ++j)
+          gi[j]=0.0;
+      }
+      const ShellRun *stop=shells.end(i+mx-1);
+      for(const ShellRun *R=shells.begin(i+mx-1); R < stop; ++R) {
+        unsigned q=bandof[R->K];
+        Vector gx=Band[2+2*q][i];
+        Vector gy=Band[3+2*q][i];
+        for(unsigned j=R->start; j < R->stop; ++j) {
+          Complex wij=wi[j];
+          gx[j]=Complex(-i*wij.im,i*wij.re);
+          gy[j]=Complex(-(int) j*wij.im,j*wij.re);
+        }
+      }
+      if(i > 0)
+        for(unsigned a=0; a < 2+2*bands; ++a)
+          Band[a][-i][0]=conj(Band[a][i][0]);
+    }
+    for(unsigned a=0; a < 2+2*bands; ++a) {
+      ZeroNyquist(Band[a]);
+      Band[a][0][0]=0.0;
+    }
+
+    BandConvolution->convolve(Fband,multbands2,false);
+
+    for(int i=-mx+1; i < mx; ++i) {
+      Vector wi=w[i];
+      rVector k2invi=k2inv[i];
+      const ShellRun *stop=shells.end(i+mx-1);
+      for(const ShellRun *R=shells.begin(i+mx-1); R < stop; ++R) {
+        unsigned K=R->K;
+        for(unsigned q=0; q < bands; ++q) {
+          Vector Ni=Band[q][i];
+          Real Z=0.0, E=0.0;
+          for(unsigned j=R->start; j < R->stop; ++j) {
+            Real T=-realproduct(Ni[j],wi[j]);
+            Z += T;
+            E += T*k2invi[j];
+          }
+          TbandZ(q,K) += Minv*Z;
+          TbandE(q,K) += Minv*E;
+        }
+      }
+    }
+  }
+  w.Set(Y[OMEGA]);
+}
+
+void DNS::OutBandTransfer()
+{
+  ostringstream buf;
+  buf << "bands" << dirsep << "t" << tcount;
+  const string& s=buf.str();
+  open_output(fbands,dirsep,s.c_str(),0);
+  out_curve(fbands,t,"t");
+  out_curve(fbands,(Real *) bandedge,"kQ",bands+1);
+  out_curve(fbands,(Real *) TbandE,"TE",bands*nshells);
+  out_curve(fbands,(Real *) TbandZ,"TZ",bands*nshells);
+  fbands.close();
+  if(!fbands) msg(ERROR,"Cannot write to file bands");
+}
+
+// Gather the current shell integrals in the order Ek, TE, TZ, eps, eta,
+// zeta, DE, DZ.
+void DNS::ShellValues(const rVector& y)
+{
+  Real (*f[])(unsigned)={cwrap::Spectrum,cwrap::TE,cwrap::TZ,cwrap::Eps,
+                         cwrap::Eta,cwrap::Zeta,cwrap::DE,cwrap::DZ};
+  for(unsigned q=0; q < 8; ++q)
+    for(unsigned K=0; K < nshells; ++K)
+      y[q*nshells+K]=f[q](K);
+}
+
+// Accumulate the mean rates of the shell integrals over the last output
+// interval, and the modal energies, into the running time averages.
+void DNS::Average(bool rezeroing)
+{
+  if(spectrum) {
+    unsigned n=shellavg.size();
+    ShellValues(shellrate);
+    if(havelast && tlast >= avgstart && t <= avgstop && t > tlast) {
+      Real dt=t-tlast;
+      Real dtinv=1.0/dt;
+      // An instantaneous Ek (spectrum=2) is sampled rather than differenced.
+      for(unsigned i=spectrum > 1 ? nshells : 0; i < n; ++i) {
+        Real y=shellrate[i];
+        shellrate[i]=(y-shelllast[i])*dtinv;
+        shelllast[i]=y;
+      }
+      shellavg.Accumulate(shellrate,dt);
+      if(tavg0 == tavg1) tavg0=tlast;
+      tavg1=t;
+    } else {
+      for(unsigned i=0; i < n; ++i)
+        shelllast[i]=shellrate[i];
+    }
+    // The integrals restart from zero after a rezero.
+    if(rezeroing) shelllast=0.0;
+  }
+
+  if(averaging > 1) {
+    if(havelast && t >= avgstart && t <= avgstop && t > tmodal) {
+      modal=0.0;
+      for(unsigned e=0; e < ensemble; ++e) {
+        w.Set(Y[OMEGA]+e*nmode);
+#pragma omp parallel for num_threads(threads)
+        for(int i=-mx+1; i < mx; ++i) {
+          Vector wi=w[i];
+          rVector k2invi=k2inv[i];
+          Real *modali=modal+(i+mx-1)*my;
+          for(int j=i <= 0 ? 1 : 0; j < my; ++j)
+            modali[j] += 0.5*abs2(wi[j])*k2invi[j]*Minv;
+        }
+      }
+      w.Set(Y[OMEGA]);
+      modeavg.Accumulate(modal,t-tmodal);
+    }
+    tmodal=t;
+  }
+
+  tlast=t;
+  havelast=true;
+
+  if(spectrum) OutAverages(false);
+}
+
+// Write the running averages: the shell averages at every output, so that
+// they survive a restart, and the modal averages only at the end of a run.
+void DNS::OutAverages(bool final)
+{
+  if(spectrum) {
+    open_output(fmean,dirsep,"mean",0);
+    out_curve(fmean,tavg0,"t0");
+    out_curve(fmean,tavg1,"t1");
+    for(unsigned q=0; q < 8; ++q)
+      shellavg.Write(fmean,q*nshells,nshells);
+    fmean.close();
+    if(!fmean) msg(ERROR,"Cannot write to file mean");
+  }
+
+  if(final && averaging > 1) {
+    open_output(fmean,dirsep,"meanek",0);
+    out_curve(fmean,modeavg.weight(),"T");
+    fmean << 2*mx-1 << my;
+    modeavg.Write(fmean,0,nmode);
+    fmean.close();
+    if(!fmean) msg(ERROR,"Cannot write to file meanek");
+  }
+}
+
+// Restore the shell averages accumulated before a restart.
+void DNS::ReadAverages()
+{
+  if(!spectrum) return;
+  ixstream fin(Vocabulary->FileName(dirsep,"mean"));
+  if(!fin) return;
+  unsigned n;
+  fin >> n >> tavg0 >> n >> tavg1;
+  for(unsigned q=0; q < 8; ++q)
+    if(!shellavg.Read(fin,q*nshells,nshells,tavg1-tavg0))
+      msg(ERROR,"Cannot read file mean");
+}
+
+// Choose the next timestep from the maximum velocities reached during the
+// last step, which the multiply pass of the convolution gathers for free.
+void DNS::CFL()
+{
+  Real rate=umaxstep*(mx-1)+vmaxstep*(my-1);
+  if(rate > 0.0)
+    Integrator->ChangeTimestep(cfl/rate);
+  umaxstep=vmaxstep=0.0;
+}
+
+// Append the probed modes to the buffer, writing it out when full.
+void DNS::Probe(const vector2& Y, double t)
+{
+  w.Set(Y[OMEGA]);
+  Complex *z=probe.Record(t);
+  for(unsigned p=0; p < probes; ++p) {
+    int i=kxprobes[p];
+    int j=kyprobes[p];
+    // Modes with j < 0, or j=0 and i < 0, are conjugates of stored modes.
+    z[p]=(j < 0 || (j == 0 && i < 0)) ? conj(w[-i][-j]) : w[i][j];
+  }
+  if(probe.Full()) probe.Flush(fprobe);
+}
+
 void DNS::FinalOutput()
 {
+  w.Set(Y[OMEGA]);
+
+  if(framedue || physicaldue) {
+    if(ensemble > 1) {
+      Complex *f=ComplexAlign(ensemble*nmode);
+      EnsembleAdvection(f,Y[OMEGA]);
+      deleteAlign(f);
+    } else {
+      Complex *f=ComplexAlign((Nx+1)*my);
+      Advection(f);
+      deleteAlign(f);
+    }
+  }
+
+  if(images) delete Images; // Wait for the last image
+
+  if(averaging) OutAverages(true);
+
+  if(probes) probe.Flush(fprobe);
+
   Real E,Z,P;
   ComputeInvariants(w,E,Z,P);
   cout << endl;
@@ -8,8 +8,13 @@
 #include "convolution.h"
 #include "Forcing.h"
 #include "InitialCondition.h"
+#include "shells.h"
+#include "sum.h"
+#include "wisdom.h"
+#include "probe.h"
 #include "Conservative.h"
 #include "Exponential.h"
+#include "LowStorage.h"
 #include <sys/stat.h> // On Sun computers this must come after xstream.h
 
 using namespace Array;
@@ -21,11 +26,39 @@ using fftwpp::twopi;
 typedef Array1<Var>::opt Vector;
 typedef Array1<Real>::opt rVector;
 
+#include "Average.h"
+#include "Image.h"
+
 extern unsigned spectrum;
+extern unsigned movie;
+extern unsigned capture;
+extern unsigned images;
+extern unsigned imagestride;
+extern unsigned ensemble;
+extern unsigned physical;
+extern unsigned pdfbins;
+extern Real pdfrange;
 
 extern int pH;
 extern int pL;
 
+void multcapture2(double **F, unsigned int m,
+                  const unsigned int indexsize,
+                  const unsigned int *index,
+                  unsigned int r, unsigned int threads);
+void multphysical2(double **F, unsigned int m,
+                   const unsigned int indexsize,
+                   const unsigned int *index,
+                   unsigned int r, unsigned int threads);
+void multensemble2(double **F, unsigned int m,
+                   const unsigned int indexsize,
+                   const unsigned int *index,
+                   unsigned int r, unsigned int threads);
+void multscalar2(double **F, unsigned int m,
+                 const unsigned int indexsize,
+                 const unsigned int *index,
+                 unsigned int r, unsigned int threads);
+
 class DNSBase {
 protected:
   // Vocabulary:
@@ -33,11 +66,22 @@ protected:
   unsigned Ny;
   Real nuH,nuL;
   Real kH2,kL2;
+  unsigned seed;
 
   // Contiguous: TRANSFERE,TRANSFERZ,EPS,ETA,ZETA,DISSIPATIONE,DISSIPATIONZ
   //
+  // TRANSFERS, EPSS, and DISSIPATIONS hold the variance transfer, injection,
+  // and dissipation of each passive scalar, shell by shell.
+  //
+  // SUM and CARRY hold the compensated totals of the shell integrals
+  // TRANSFERE...DISSIPATIONS, which themselves only integrate the current
+  // step.
+  //
+  // SCALAR holds the passive scalars. They lie outside the index limits of
+  // the integrators, so their diffusion is part of every source.
   enum Field {PAD,OMEGA,TRANSFERE,TRANSFERZ,EPS,ETA,ZETA,DISSIPATIONE,
-              DISSIPATIONZ,EK};
+              DISSIPATIONZ,EK,TRANSFERS,EPSS,DISSIPATIONS,SUM,CARRY,SCALAR};
+  static const unsigned nshellfields=EK-TRANSFERE+1;
 
   int mx,my; // size of data arrays
 
@@ -47,20 +91,66 @@ protected:
   int tcount;
   unsigned fcount;
 
-  unsigned nmode;
+  unsigned nmode; // Number of modes per ensemble member
   unsigned nshells;  // Number of spectral shells
+  ShellIndex shells; // Shell runs of each row i
 
   Array2<Complex> f0,f1;
   Array2<Complex> S;
   array2<Complex> buffer;
-  Complex *F[2];
+  Complex **F; // u, v, then the gradient (x,y) of each scalar
   Complex *block;
   ImplicitHConvolution2 *Convolution;
   crfft2d *Backward;
 
+  // Movie frames captured from the physical-space stage of the convolution:
+  Array2<Complex> f2; // Vorticity input to CaptureConvolution
+  Complex *G[3];
+  ImplicitHConvolution2 *CaptureConvolution;
+  bool framedue; // Capture a frame on the next call to Advection
+  unsigned nxp,nyp; // Size of the dealiased physical-space grid
+  array2<float> wframe,uframe,vframe;
+  ImageWriter *Images; // In-situ images of wframe
+  int imagecount;
+
+  // Ensemble members advanced in lockstep by one batched convolution:
+  Complex *ensembleblock;
+  Array2<Complex> *U,*V; // Velocity inputs and product outputs per member
+  Complex **Fensemble;
+  ImplicitHConvolution2 *EnsembleConvolution;
+  Real Minv; // Normalization of ensemble-averaged diagnostics
+
+  // Passive scalars advected by the convolution of the velocity:
+  unsigned nscalars;
+  Real *kappa; // Diffusivity of each scalar
+  Real *scalareta; // Variance injection rate of each scalar
+  Array2<Complex> theta; // Current scalar
+  Complex *scalarblock;
+  Array2<Complex> *Theta; // Gradients of each scalar, then u.grad theta
+
+  // Pointwise reductions computed in the multiply pass of the convolution:
+  enum Reduction {MAXIMA=1,MOMENTS=2,VORTICITY=4,PDF=8};
+  struct Moments {
+    Real umax,vmax,wmax;
+    Real u2,u4,v2,v4,w2,w4;
+    Real n;
+    void clear() {umax=vmax=wmax=u2=u4=v2=v4=w2=w4=n=0.0;}
+  };
+  unsigned reductions; // Reductions performed on every call to Advection
+  unsigned active; // Reductions performed by the current call to Advection
+  bool physicaldue; // Output physical-space diagnostics on the next call
+  Moments *moments; // Per-thread partial reductions
+  Moments stats; // Reductions combined over all threads
+  array2<Real> histogram; // Per-thread velocity histograms
+  Array1<Real>::opt pdf;
+  Real urms; // Velocity scale of the histograms
+  Real umaxstep,vmaxstep; // Maximum velocities over the stages of a step
+  Real tphysical;
+  int pdfcount;
+
   ifstream ftin;
-  oxstream fek,fw,fekvk,ftransfer;
-  ofstream ft,fevt;
+  oxstream fek,fw,fvx,fvy,fekvk,ftransfer,fpdf;
+  ofstream ft,fevt,fphysical;
 
   uvector count;
 
@@ -68,18 +158,23 @@ protected:
   vector Eps,Eta,Zeta; // Energy, enstrophy, and palenstrophy injection rates
   vector DE,DZ; // Energy and enstrophy dissipation rates
   vector E; // Energy spectrum
+  vector TS,ES,DS; // Scalar variance transfer, injection, and dissipation
 
-  Real Energy,Enstrophy,Palinstrophy;
+  array2<Real> invariants; // Row partial sums of E, Z, and P
   Array2<Real> k2inv;
 
 public:
   void Initialize() {
     fevt << "# t\tE\tZ\tP" << endl;
+    if(physical)
+      fphysical << "# t\tumax\tvmax\twmax\tFu\tFv\tFw" << endl;
   }
 
-  void InitialConditions() {
+  // Fill w with the initial condition; each stream (e.g. ensemble member)
+  // draws its own random phases.
+  void InitialConditions(unsigned stream=0) {
     w[0][0]=0.0; // Enforce no mean flow
-    Loop(Initw(this),InitializeValue(this));
+    InitialCondition->Fill(w,mx,my,CounterRNG(seed,stream),threads);
     fftwpp::HermitianSymmetrizeX(mx,my,mx-1,w);
   }
 
@@ -95,6 +190,7 @@ public:
 
     Forcing->Init(fcount);
 
+    invariants.Allocate(Nx,3);
     k2inv.Allocate(Nx,my,-mx+1,0);
     for(int i=-mx+1; i < mx; ++i) {
       int i2=i*i;
@@ -111,19 +207,18 @@ public:
       count[i]=0;
 
     if(spectrum)
-      Loop(InitNone(this),Count(this));
+      ShellLoop(InitNone(this),Count(this));
   }
 
   virtual void OutEnergies() {
-    fftwpp::HermitianSymmetrizeX(mx,my,mx-1,w);
     fek << 2*mx-1 << my;
     for(int i=-mx+1; i < mx; ++i) {
       const Vector& wi=w[i];
-      for(int j=0; j < my; ++j) {
-        Real k2=i*i+j*j;
-        Real k2inv=k2 > 0.0 ? 1.0/k2 : 0.0;
-        fek << 0.5*abs2(wi[j])*k2inv;
-      }
+      // Mode (i,0) of the lower half plane is the conjugate of (-i,0).
+      int I=i < 0 ? -i : i;
+      fek << (I > 0 ? 0.5*abs2(w[I][0])/(i*i) : 0.0);
+      for(int j=1; j < my; ++j)
+        fek << 0.5*abs2(wi[j])/(i*i+j*j);
     }
   }
 
@@ -137,11 +232,12 @@ public:
   }
 
   void OutFrame(int it) {
-    for(int i=-mx+1; i < mx; ++i)
-      for(int j=0; j < my; ++j)
-        f1[i][j]=w(i,j);
-
-    fftwpp::HermitianSymmetrizeX(mx,my,mx,f1);
+    for(int i=-mx+1; i < mx; ++i) {
+      Vector f1i=f1[i];
+      f1i[0]=i < 0 ? conj(w(-i,0)) : w(i,0);
+      for(int j=1; j < my; ++j)
+        f1i[j]=w(i,j);
+    }
 
 // Zero Nyquist modes.
     for(int j=0; j < my; ++j)
@@ -160,6 +256,192 @@ public:
       f1(j)=0.0;
   }
 
+  // Store the physical-space fields seen by the multiplier for padded row x
+  // and residue r: element j lies at y=3*j+r.
+  void Capture(double **F, unsigned m, unsigned x, unsigned r) {
+    if(x >= nxp) return;
+    float *wx=wframe[x];
+    double *F2=F[2];
+    for(unsigned j=0; j < m; ++j) {
+      unsigned y=3*j+r;
+      if(y < nyp) wx[y]=F2[j];
+    }
+    if(capture > 1) {
+      float *ux=uframe[x];
+      float *vx=vframe[x];
+      double *F0=F[0];
+      double *F1=F[1];
+      for(unsigned j=0; j < m; ++j) {
+        unsigned y=3*j+r;
+        if(y < nyp) {
+          ux[y]=F0[j];
+          vx[y]=F1[j];
+        }
+      }
+    }
+  }
+
+  void OutFrame(oxstream& fout, const array2<float>& frame) {
+    fout << 1 << nyp << nxp;
+    for(int j=nyp-1; j >= 0; j--)
+      for(unsigned i=0; i < nxp; i++)
+        fout << frame(i,j);
+    fout.flush();
+  }
+
+  // Called by the multiplier with the physical-space fields at padded row x
+  // and residue r; F[2] holds the vorticity if it was a convolution input.
+  void PhysicalSpace(double **F, unsigned m, unsigned x, unsigned r,
+                     bool vorticity) {
+    if(framedue) Capture(F,m,x,r);
+    Reduce(F,m,x,r,vorticity);
+  }
+
+  bool Reducing() {return active != 0;}
+
+  // Accumulate the reductions over the points y=3*j+r < nyp of padded row
+  // x < nxp; as in Capture, the padding beyond the physical grid is skipped.
+  void Reduce(double **F, unsigned m, unsigned x, unsigned r,
+              bool vorticity) {
+    if(x >= nxp) return;
+    unsigned n=(nyp+2-r)/3;
+    if(m > n) m=n;
+    int t=get_thread_num();
+    Moments& M=moments[t];
+    double *F0=F[0];
+    double *F1=F[1];
+    if(active & MAXIMA) {
+      Real umax=M.umax;
+      Real vmax=M.vmax;
+      for(unsigned j=0; j < m; ++j) {
+        Real u=fabs(F0[j]);
+        Real v=fabs(F1[j]);
+        if(u > umax) umax=u;
+        if(v > vmax) vmax=v;
+      }
+      M.umax=umax;
+      M.vmax=vmax;
+    }
+    if(active & MOMENTS) {
+      Real u2=0.0, u4=0.0, v2=0.0, v4=0.0;
+      for(unsigned j=0; j < m; ++j) {
+        Real U2=F0[j]*F0[j];
+        Real V2=F1[j]*F1[j];
+        u2 += U2;
+        u4 += U2*U2;
+        v2 += V2;
+        v4 += V2*V2;
+      }
+      M.u2 += u2;
+      M.u4 += u4;
+      M.v2 += v2;
+      M.v4 += v4;
+      M.n += m;
+    }
+    if(vorticity && (active & VORTICITY)) {
+      double *F2=F[2];
+      Real wmax=M.wmax;
+      Real w2=0.0, w4=0.0;
+      for(unsigned j=0; j < m; ++j) {
+        Real W=F2[j];
+        Real W2=W*W;
+        if(fabs(W) > wmax) wmax=fabs(W);
+        w2 += W2;
+        w4 += W2*W2;
+      }
+      M.wmax=wmax;
+      M.w2 += w2;
+      M.w4 += w4;
+    }
+    if(active & PDF) {
+      Real *hu=histogram[t];
+      Real *hv=hu+pdfbins;
+      Real offset=pdfrange*urms;
+      Real scale=offset > 0.0 ? 0.5*pdfbins/offset : 0.0;
+      for(unsigned j=0; j < m; ++j) {
+        int bu=(int) floor((F0[j]+offset)*scale);
+        int bv=(int) floor((F1[j]+offset)*scale);
+        if(bu >= 0 && bu < (int) pdfbins) ++hu[bu];
+        if(bv >= 0 && bv < (int) pdfbins) ++hv[bv];
+      }
+    }
+  }
+
+  void ClearReductions() {
+    for(int t=0; t < threads; ++t)
+      moments[t].clear();
+    if(active & PDF) histogram=0.0;
+  }
+
+  void CombineReductions() {
+    stats.clear();
+    for(int t=0; t < threads; ++t) {
+      Moments& M=moments[t];
+      if(M.umax > stats.umax) stats.umax=M.umax;
+      if(M.vmax > stats.vmax) stats.vmax=M.vmax;
+      if(M.wmax > stats.wmax) stats.wmax=M.wmax;
+      stats.u2 += M.u2;
+      stats.u4 += M.u4;
+      stats.v2 += M.v2;
+      stats.v4 += M.v4;
+      stats.w2 += M.w2;
+      stats.w4 += M.w4;
+      stats.n += M.n;
+    }
+  }
+
+  static Real flatness(Real x2, Real x4, Real n) {
+    return x2 > 0.0 ? n*x4/(x2*x2) : 0.0;
+  }
+
+  void OutPhysical() {
+    fphysical << tphysical << "\t" << stats.umax << "\t" << stats.vmax
+              << "\t" << stats.wmax
+              << "\t" << flatness(stats.u2,stats.u4,stats.n)
+              << "\t" << flatness(stats.v2,stats.v4,stats.n)
+              << "\t" << flatness(stats.w2,stats.w4,stats.n) << endl;
+
+    if(pdfbins == 0) return;
+
+    // Normalize the histograms to probability densities.
+    pdf=0.0;
+    for(int t=0; t < threads; ++t) {
+      Real *h=histogram[t];
+      for(unsigned b=0; b < 2*pdfbins; ++b)
+        pdf[b] += h[b];
+    }
+    Real width=2.0*pdfrange*urms/pdfbins;
+    Real norm=stats.n > 0.0 && width > 0.0 ? 1.0/(stats.n*width) : 0.0;
+    for(unsigned b=0; b < 2*pdfbins; ++b)
+      pdf[b] *= norm;
+
+    ostringstream buf;
+    buf << "pdf" << dirsep << "t" << pdfcount;
+    const string& s=buf.str();
+    open_output(fpdf,dirsep,s.c_str(),0);
+    out_curve(fpdf,tphysical,"t");
+    out_curve(fpdf,urms,"urms");
+    out_curve(fpdf,(Real *) pdf,"pdfu",pdfbins);
+    out_curve(fpdf,(Real *) pdf+pdfbins,"pdfv",pdfbins);
+    fpdf.close();
+    if(!fpdf) msg(ERROR,"Cannot write to file pdf");
+  }
+
+  void OutCapture() {
+    OutFrame(fw,wframe);
+    if(capture > 1) {
+      OutFrame(fvx,uframe);
+      OutFrame(fvy,vframe);
+    }
+  }
+
+  void OutImage() {
+    ostringstream buf;
+    buf << "images" << dirsep << "w" << imagecount << Images->Extension();
+    Images->Post(wframe,imagestride,Vocabulary->FileName(dirsep,
+                                                         buf.str().c_str()));
+  }
+
   class FETL {
     DNSBase *b;
     const vector& TE,TZ,Eps,Eta,Zeta,DE,DZ,E;
@@ -168,10 +450,10 @@ public:
     FETL(DNSBase *b) : b(b), TE(b->TE), TZ(b->TZ),
                        Eps(b->Eps), Eta(b->Eta), Zeta(b->Zeta),
                        DE(b->DE), DZ(b->DZ), E(b->E) {}
-    inline void operator()(const Vector& wi, const Vector& Si, int i, int j) {
+    inline void operator()(const Vector& wi, const Vector& Si, int i, int j,
+                           unsigned index) {
       unsigned k2=i*i+j*j;
       Real k=sqrt(k2);
-      unsigned index=(unsigned)(k-0.5);
       Complex wij=wi[j];
       Real w2=abs2(wij);
       Complex& Sij=Si[j];
@@ -201,10 +483,9 @@ public:
     FTL(DNSBase *b) : b(b), TE(b->TE), TZ(b->TZ),
                       Eps(b->Eps), Eta(b->Eta), Zeta(b->Zeta),
                       DE(b->DE), DZ(b->DZ) {}
-    inline void operator()(const Vector& wi, const Vector& Si, int i, int j) {
+    inline void operator()(const Vector& wi, const Vector& Si, int i, int j,
+                           unsigned index) {
       unsigned k2=i*i+j*j;
-      Real k=sqrt(k2);
-      unsigned index=(unsigned)(k-0.5);
       Complex wij=wi[j];
       Complex& Sij=Si[j];
       Real transfer=realproduct(Sij,wij);
@@ -231,10 +512,10 @@ public:
     FET(DNSBase *b) : b(b), TE(b->TE), TZ(b->TZ),
                       Eps(b->Eps), Eta(b->Eta), Zeta(b->Zeta),
                       DE(b->DE), DZ(b->DZ), E(b->E) {}
-    inline void operator()(const Vector& wi, const Vector& Si, int i, int j) {
+    inline void operator()(const Vector& wi, const Vector& Si, int i, int j,
+                           unsigned index) {
       unsigned k2=i*i+j*j;
       Real k=sqrt(k2);
-      unsigned index=(unsigned)(k-0.5);
       Complex wij=wi[j];
       Real w2=abs2(wij);
       Complex& Sij=Si[j];
@@ -254,16 +535,43 @@ public:
     }
   };
 
+  class FT {
+    DNSBase *b;
+    const vector& TE,TZ,Eps,Eta,Zeta,DE,DZ;
+
+  public:
+    FT(DNSBase *b) : b(b), TE(b->TE), TZ(b->TZ),
+                     Eps(b->Eps), Eta(b->Eta), Zeta(b->Zeta),
+                     DE(b->DE), DZ(b->DZ) {}
+    inline void operator()(const Vector& wi, const Vector& Si, int i, int j,
+                           unsigned index) {
+      unsigned k2=i*i+j*j;
+      Complex wij=wi[j];
+      Complex& Sij=Si[j];
+      Real transfer=realproduct(Sij,wij);
+      Real eta=Forcing->Force(wij,Sij,i,j);
+      Real kinv2=1.0/k2;
+      Real nuk2Z=b->nuk(k2)*abs2(wij);
+      TE[index] += kinv2*transfer;
+      TZ[index] += transfer;
+      Eps[index] += kinv2*eta;
+      Eta[index] += eta;
+      Zeta[index] += k2*eta;
+      DE[index] += kinv2*nuk2Z;
+      DZ[index] += nuk2Z;
+    }
+  };
+
   class FE {
     DNSBase *b;
     const vector& E;
 
   public:
     FE(DNSBase *b) : b(b), E(b->E) {}
-    inline void operator()(const Vector& wi, const Vector& Si, int i, int j) {
+    inline void operator()(const Vector& wi, const Vector& Si, int i, int j,
+                           unsigned index) {
       unsigned k2=i*i+j*j;
       Real k=sqrt(k2);
-      unsigned index=(unsigned)(k-0.5);
       E[index] += abs2(wi[j])/k;
     }
   };
@@ -281,14 +589,83 @@ public:
     }
   };
 
+  // Variance transfer and diffusion of scalar s.
+  class FS {
+    Var *TS,*DS;
+    Real kappa;
+
+  public:
+    FS(DNSBase *b, unsigned s) : TS(b->TS+s*b->nshells),
+                                 DS(b->DS+s*b->nshells),
+                                 kappa(b->kappa[s]) {}
+    inline void operator()(const Vector& wi, const Vector& Si, int i, int j,
+                           unsigned index) {
+      Real kappak2=kappa*(i*i+j*j);
+      Complex thetaij=wi[j];
+      Complex& Sij=Si[j];
+      TS[index] += realproduct(Sij,thetaij);
+      DS[index] += kappak2*abs2(thetaij);
+      Sij -= kappak2*thetaij;
+    }
+  };
+
+  class FSL {
+    Real kappa;
+
+  public:
+    FSL(DNSBase *b, unsigned s) : kappa(b->kappa[s]) {}
+    inline void operator()(const Vector& wi, const Vector& Si, int i, int j) {
+      Si[j] -= kappa*(i*i+j*j)*wi[j];
+    }
+  };
+
+  // Variance spectrum of scalar s.
+  class FV {
+    Var *V;
+
+  public:
+    FV(DNSBase *b, const vector& V, unsigned s) : V(V+s*b->nshells) {}
+    inline void operator()(const Vector& wi, const Vector&, int i, int j,
+                           unsigned index) {
+      V[index] += sqrt((Real) (i*i+j*j))*abs2(wi[j]);
+    }
+  };
+
+  // Scalars are forced in the band of the vorticity forcing.
+  class ScalarForce {
+    Var *ES;
+    Real f0;
+  public:
+    ScalarForce(DNSBase *b, unsigned s, Real f0) : ES(b->ES+s*b->nshells),
+                                                   f0(f0) {}
+    inline void operator()(const Vector& wi, const Vector&, int i, int j,
+                           unsigned index) {
+      if(Forcing->active(i,j)) {
+        Complex f=f0*crand_gauss();
+        Complex& thetaij=wi[j];
+        ES[index] += realproduct(f,thetaij)+0.5*abs2(f);
+        thetaij += f;
+      }
+    }
+  };
+
+  class ScalarForceNO {
+    Real f0;
+  public:
+    ScalarForceNO(DNSBase *b, Real f0) : f0(f0) {}
+    inline void operator()(const Vector& wi, const Vector&, int i, int j) {
+      if(Forcing->active(i,j))
+        wi[j] += f0*crand_gauss();
+    }
+  };
+
   class ForceStochastic {
     const vector& Eps,Eta,Zeta;
   public:
     ForceStochastic(DNSBase *b) : Eps(b->Eps), Eta(b->Eta), Zeta(b->Zeta) {}
-    inline void operator()(const Vector& wi, const Vector&, int i, int j) {
+    inline void operator()(const Vector& wi, const Vector&, int i, int j,
+                           unsigned index) {
       unsigned k2=i*i+j*j;
-      Real k=sqrt(k2);
-      unsigned index=(unsigned)(k-0.5);
       double eta=Forcing->ForceStochastic(wi[j],i,j);
       Eps[index] += eta/k2;
       Eta[index] += eta;
@@ -304,14 +681,6 @@ public:
     }
   };
 
-  class InitializeValue {
-  public:
-    InitializeValue(DNSBase *b) {}
-    inline void operator()(const Vector& wi, const Vector& Si, int i, int j) {
-      wi[j]=InitialCondition->Value(i,j);
-    }
-  };
-
   class ForcingCount {
     DNSBase *b;
   public:
@@ -323,21 +692,6 @@ public:
     }
   };
 
-  class Invariants {
-    DNSBase *b;
-    Real &Energy,&Enstrophy,&Palinstrophy;
-  public:
-    Invariants(DNSBase *b) : b(b), Energy(b->Energy), Enstrophy(b->Enstrophy),
-                             Palinstrophy(b->Palinstrophy) {}
-    inline void operator()(const Vector& wi, const Vector& Si, int i, int j) {
-      Real w2=abs2(wi[j]);
-      Enstrophy += w2;
-      unsigned k2=i*i+j*j;
-      Energy += w2/k2;
-      Palinstrophy += k2*w2;
-    }
-  };
-
   class InitwS {
     DNSBase *b;
   public:
@@ -369,54 +723,234 @@ public:
     const uvector& count;
   public:
     Count(DNSBase *b) : b(b), count(b->count) {}
-    inline void operator()(const Vector& wi, const Vector& Si, int i, int j) {
-      unsigned k2=i*i+j*j;
-      Real k=sqrt(k2);
-      unsigned index=(unsigned)(k-0.5);
+    inline void operator()(const Vector& wi, const Vector& Si, int i, int j,
+                           unsigned index) {
       ++count[index];
     }
   };
 
-  void NonLinearSource(const vector2& Src, const vector2& Y, double t) {
-    f0.Dimension(Nx+1,my,-mx,0);
+  // Zero the x-Nyquist row i=-mx of a convolution input. The convolutions
+  // are not asked to symmetrize their inputs, and this row is otherwise
+  // left over from the previous output or from the integrator.
+  void ZeroNyquist(Complex *f) {
+    for(int j=0; j < my; ++j)
+      f[j]=0.0;
+  }
+
+  // Velocity (u,v) of row i of the vorticity.
+  inline void Velocity(const Vector& wi, const Vector& ui, const Vector& vi,
+                       int i) {
+    rVector k2invi=k2inv[i];
+    for(int j=i <= 0 ? 1 : 0; j < my; ++j) {
+      Complex wij=wi[j];
+      Real k2invij=k2invi[j];
+      Real jk2inv=j*k2invij;
+      Real ik2inv=i*k2invij;
+      ui[j]=Complex(-wij.im*jk2inv,wij.re*jk2inv);
+      vi[j]=Complex(wij.im*ik2inv,-wij.re*ik2inv);
+    }
+  }
+
+  // Vorticity source of row i from the transforms of v^2-u^2 and uv.
+  inline void Curl(const Vector& fi, const Vector& ai, const Vector& bi,
+                   int i) {
+    Real i2=i*i;
+    for(int j=i <= 0 ? 1 : 0; j < my; ++j)
+      fi[j]=i*j*ai[j]+(i2-j*j)*bi[j];
+  }
+
+  // Gradient (x,y) of row i of a scalar.
+  inline void Gradient(const Vector& ti, const Vector& xi, const Vector& yi,
+                       int i) {
+    for(int j=i <= 0 ? 1 : 0; j < my; ++j) {
+      Complex tij=ti[j];
+      xi[j]=Complex(-i*tij.im,i*tij.re);
+      yi[j]=Complex(-j*tij.im,j*tij.re);
+    }
+  }
+
+  // Load the gradients of the scalars y into the convolution inputs.
+  void ScalarGradients(Complex *y) {
+    for(unsigned s=0; s < nscalars; ++s) {
+      theta.Set(y+s*nmode);
+      Array2<Complex>& x=Theta[2*s];
+      Array2<Complex>& Y=Theta[2*s+1];
+      ZeroNyquist(x);
+      ZeroNyquist(Y);
+      x[0][0]=0.0;
+      Y[0][0]=0.0;
+#pragma omp parallel for num_threads(threads)
+      for(int i=-mx+1; i < mx; ++i) {
+        Vector xi=x[i];
+        Vector Yi=Y[i];
+        Gradient(theta[i],xi,Yi,i);
+        if(i > 0) {
+          x[-i][0]=conj(xi[0]);
+          Y[-i][0]=conj(Yi[0]);
+        }
+      }
+    }
+  }
 
+  // Store -u.grad theta, returned in Theta[s], as the source of scalar s.
+  void ScalarAdvection(Complex *src) {
+    for(unsigned s=0; s < nscalars; ++s) {
+      theta.Set(src+s*nmode);
+      Array2<Complex>& a=Theta[s];
+#pragma omp parallel for num_threads(threads)
+      for(int i=-mx+1; i < mx; ++i) {
+        Vector ti=theta[i];
+        Vector ai=a[i];
+        for(int j=i <= 0 ? 1 : 0; j < my; ++j)
+          ti[j]=-ai[j];
+        if(i > 0) theta[-i][0]=conj(ti[0]);
+      }
+      theta[0][0]=0.0;
+    }
+  }
+
+  void FinishReductions() {
+    CombineReductions();
+    if(stats.umax > umaxstep) umaxstep=stats.umax;
+    if(stats.vmax > vmaxstep) vmaxstep=stats.vmax;
+    if(physicaldue) {
+      OutPhysical();
+      physicaldue=false;
+    }
+  }
+
+  void NonLinearSource(const vector2& Src, const vector2& Y, double t) {
+    if(ensemble > 1) {
+      EnsembleAdvection(Src[OMEGA],Y[OMEGA]);
+      return;
+    }
     w.Set(Y[OMEGA]);
-    f0.Set(Src[PAD]);
+    Advection(Src[PAD],Src[SCALAR],Y[SCALAR]);
+  }
+
+  // Advance all ensemble members with a single convolution of 2*ensemble
+  // inputs, so that the FFTs are planned once and batched across threads.
+  // Physical-space reductions are accumulated over the whole ensemble.
+  void EnsembleAdvection(Complex *src, Complex *y) {
+    active=reductions;
+    if(physicaldue) active |= MAXIMA | MOMENTS | (pdfbins ? PDF : 0);
+    if(active) ClearReductions();
+
+    for(unsigned e=0; e < ensemble; ++e) {
+      w.Set(y+e*nmode);
+      Array2<Complex>& u=U[e];
+      Array2<Complex>& v=V[e];
+      ZeroNyquist(u);
+      ZeroNyquist(v);
+      u[0][0]=0.0;
+      v[0][0]=0.0;
+#pragma omp parallel for num_threads(threads)
+      for(int i=-mx+1; i < mx; ++i) {
+        Vector ui=u[i];
+        Vector vi=v[i];
+        Velocity(w[i],ui,vi,i);
+        if(i > 0) {
+          u[-i][0]=conj(ui[0]);
+          v[-i][0]=conj(vi[0]);
+        }
+      }
+    }
 
+    EnsembleConvolution->convolve(Fensemble,multensemble2,false);
+
+    if(active) FinishReductions();
+
+    for(unsigned e=0; e < ensemble; ++e) {
+      S.Set(src+e*nmode);
+      Array2<Complex>& u=U[e];
+      Array2<Complex>& v=V[e];
+#pragma omp parallel for num_threads(threads)
+      for(int i=-mx+1; i < mx; ++i) {
+        Vector Si=S[i];
+        Curl(Si,u[i],v[i],i);
+        if(i > 0) S[-i][0]=conj(Si[0]);
+      }
+      S[0][0]=0.0;
+    }
+    w.Set(y);
+  }
+
+  // Compute the nonlinear term from w into f, which must have room for
+  // Nx+1 rows (including the Nyquist row). If y is given, the sources of
+  // the scalars y are computed into src from the same velocity transforms.
+  void Advection(Complex *f, Complex *src=NULL, Complex *y=NULL) {
+    f0.Dimension(Nx+1,my,-mx,0);
+    f0.Set(f);
+
+    ZeroNyquist(f0);
+    ZeroNyquist(f1);
     f0[0][0]=0.0;
     f1[0][0]=0.0;
 
+    active=reductions;
+    if(physicaldue) active |= MAXIMA | MOMENTS | VORTICITY | (pdfbins ? PDF : 0);
+    bool capturing=framedue || (active & VORTICITY);
+    if(capturing) {
+      ZeroNyquist(f2);
+      f2[0][0]=0.0;
+    }
+    if(active) ClearReductions();
+
     // This 2D version of the scheme of Basdevant, J. Comp. Phys, 50, 1983
     // requires only 4 FFTs per stage.
+    //
+    // Only the half plane j > 0 or (j == 0, i > 0) is evolved. The j=0
+    // conjugates of the convolution inputs and of the source are filled in
+    // the same sweeps, so no separate symmetrization passes are needed;
+    // only the Nyquist rows of the inputs are zeroed above.
 #pragma omp parallel for num_threads(threads)
     for(int i=-mx+1; i < mx; ++i) {
       Vector wi=w[i];
       Vector f0i=f0[i];
       Vector f1i=f1[i];
-      rVector k2invi=k2inv[i];
-      for(int j=i <= 0 ? 1 : 0; j < my; ++j) {
-        Complex wij=wi[j];
-        Real k2invij=k2invi[j];
-        Real jk2inv=j*k2invij;
-        Real ik2inv=i*k2invij;
-        f0i[j]=Complex(-wij.im*jk2inv,wij.re*jk2inv); // u
-        f1i[j]=Complex(wij.im*ik2inv,-wij.re*ik2inv); // v
+      Velocity(wi,f0i,f1i,i);
+      if(i > 0) {
+        f0[-i][0]=conj(f0i[0]);
+        f1[-i][0]=conj(f1i[0]);
+      }
+      if(capturing) {
+        Vector f2i=f2[i];
+        for(int j=i <= 0 ? 1 : 0; j < my; ++j)
+          f2i[j]=wi[j];
+        if(i > 0) f2[-i][0]=conj(wi[0]);
       }
     }
 
-    F[0]=f0;
-    Convolution->convolve(F,multadvection2);
+    bool scalar=nscalars && y;
+    if(scalar) ScalarGradients(y);
+
+    if(capturing) {
+      // The vorticity rides along as a third input, so frames and
+      // vorticity statistics come straight from the physical-space stage
+      // of the convolution.
+      G[0]=f0;
+      CaptureConvolution->convolve(G,multcapture2,false);
+    } else {
+      F[0]=f0;
+      Convolution->convolve(F,nscalars ? multscalar2 :
+                            active ? multphysical2 : multadvection2,false);
+    }
+
+    if(framedue) {
+      if(movie && capture) OutCapture();
+      if(images) OutImage();
+      framedue=false;
+    }
+    if(active) FinishReductions();
     f0[0][0]=0.0;
 
     for(int i=-mx+1; i < mx; ++i) {
-      Real i2=i*i;
       Vector f0i=f0[i];
-      Vector f1i=f1[i];
-      for(int j=i <= 0 ? 1 : 0; j < my; ++j) {
-        f0i[j]=i*j*f0i[j]+(i2-j*j)*f1i[j];
-      }
+      Curl(f0i,f0i,f1[i],i);
+      if(i > 0) f0[-i][0]=conj(f0i[0]);
     }
-    fftwpp::HermitianSymmetrizeX(mx,my,mx,f0);
+
+    if(scalar) ScalarAdvection(src);
 
 #if 0
     Real sum=0.0;
@@ -433,15 +967,104 @@ public:
 #endif
   }
 
-  void Init(vector& T, const vector& Src) {
+  void Init(vector& T, const vector& Src, unsigned n) {
     Set(T,Src);
 #pragma omp parallel for num_threads(threads)
-    for(unsigned K=0; K < nshells; K++)
+    for(unsigned K=0; K < n; K++)
       T[K]=0.0;
   }
 
+  void Init(vector& T, const vector& Src) {
+    Init(T,Src,nshells);
+  }
+
+  // Length of the shell field f.
+  unsigned ShellSize(unsigned f) {
+    return f < TRANSFERS ? nshells : nscalars*nshells;
+  }
+
+  // Number of compensated totals.
+  unsigned ntotals() {
+    return (nshellfields+3*nscalars)*nshells;
+  }
+
+  // Fold the shell integrals of the last step into the compensated totals.
+  void Fold(const vector2& Y) {
+    Var *s=Y[SUM];
+    Var *c=Y[CARRY];
+    for(unsigned f=TRANSFERE; f <= DISSIPATIONS; ++f) {
+      Var *y=Y[f];
+      unsigned n=ShellSize(f);
+      for(unsigned K=0; K < n; ++K) {
+        neumaier(s->re,c->re,y[K].re);
+        y[K]=0.0;
+        ++s;
+        ++c;
+      }
+    }
+  }
+
+  // The totals are constant during a step.
+  void ZeroTotals(const vector2& Src) {
+    Var *s=Src[SUM];
+    Var *c=Src[CARRY];
+    unsigned n=ntotals();
+    for(unsigned i=0; i < n; ++i)
+      s[i]=c[i]=0.0;
+  }
+
+  // Diffusion (and with spectrum, the variance budget) of the scalars,
+  // whose advection is already in Src.
+  void ScalarSource(const vector2& Src, const vector2& Y) {
+    if(spectrum) {
+      unsigned n=nscalars*nshells;
+      Init(TS,Src[TRANSFERS],n);
+      Init(ES,Src[EPSS],n);
+      Init(DS,Src[DISSIPATIONS],n);
+    }
+    for(unsigned s=0; s < nscalars; ++s) {
+      S.Set(Src[SCALAR]+s*nmode);
+      w.Set(Y[SCALAR]+s*nmode);
+      if(spectrum)
+        ShellLoop(InitwS(this),FS(this,s));
+      else
+        Loop(InitwS(this),FSL(this,s));
+    }
+    w.Set(Y[OMEGA]);
+  }
+
+  // Instantaneous variance spectra of the scalars.
+  void ScalarSpectrum(const vector2& Y, const vector& V) {
+    unsigned n=nscalars*nshells;
+    for(unsigned K=0; K < n; K++)
+      V[K]=0.0;
+    for(unsigned s=0; s < nscalars; ++s) {
+      w.Set(Y[SCALAR]+s*nmode);
+      ShellLoop(Initw(this),FV(this,V,s));
+    }
+    w.Set(Y[OMEGA]);
+  }
+
+  void ScalarStochastic(const vector2& Y, double dt) {
+    if(fcount == 0) return;
+    if(spectrum) Set(ES,Y[EPSS]);
+    for(unsigned s=0; s < nscalars; ++s) {
+      Real eta=scalareta[s];
+      if(eta == 0.0) continue;
+      Real f0=sqrt(2.0*dt*eta/fcount);
+      w.Set(Y[SCALAR]+s*nmode);
+      if(spectrum)
+        ShellLoop(Initw(this),ScalarForce(this,s,f0));
+      else
+        Loop(Initw(this),ScalarForceNO(this,f0));
+    }
+    w.Set(Y[OMEGA]);
+  }
+
   void ConservativeSource(const vector2& Src, const vector2& Y, double t) {
     NonLinearSource(Src,Y,t);
+    if(spectrum) ZeroTotals(Src);
+    if(nscalars) ScalarSource(Src,Y);
     if(spectrum) {
       Init(TE,Src[TRANSFERE]);
       Init(TZ,Src[TRANSFERZ]);
@@ -450,21 +1073,27 @@ public:
       Init(Zeta,Src[ZETA]);
       Init(DE,Src[DISSIPATIONE]);
       Init(DZ,Src[DISSIPATIONZ]);
-      Compute(FTL(this),Src,Y);
+      ShellCompute(FTL(this),Src,Y);
     }
     else
       Compute(FL(this),Src,Y);
   }
 
+  // With spectrum=2 the energy spectrum is not integrated: it is computed
+  // from w only at output times (see InstantaneousSpectrum).
   void NonConservativeSource(const vector2& Src, const vector2& Y, double t) {
     if(spectrum) {
+      ZeroTotals(Src);
       Init(E,Src[EK]);
-      Compute(FE(this),Src,Y);
+      if(spectrum == 1)
+        ShellCompute(FE(this),Src,Y);
     }
   }
 
   void ExponentialSource(const vector2& Src, const vector2& Y, double t) {
     NonLinearSource(Src,Y,t);
+    if(spectrum) ZeroTotals(Src);
+    if(nscalars) ScalarSource(Src,Y);
     if(spectrum) {
       Init(TE,Src[TRANSFERE]);
       Init(TZ,Src[TRANSFERZ]);
@@ -474,12 +1103,17 @@ public:
       Init(DE,Src[DISSIPATIONE]);
       Init(DZ,Src[DISSIPATIONZ]);
       Init(E,Src[EK]);
-      Compute(FET(this),Src,Y);
+      if(spectrum == 1)
+        ShellCompute(FET(this),Src,Y);
+      else
+        ShellCompute(FT(this),Src,Y);
     }
   }
 
   void Source(const vector2& Src, const vector2& Y, double t) {
     NonLinearSource(Src,Y,t);
+    if(spectrum) ZeroTotals(Src);
+    if(nscalars) ScalarSource(Src,Y);
     if(spectrum) {
       Init(TE,Src[TRANSFERE]);
       Init(TZ,Src[TRANSFERZ]);
@@ -489,7 +1123,10 @@ public:
       Init(DE,Src[DISSIPATIONE]);
       Init(DZ,Src[DISSIPATIONZ]);
       Init(E,Src[EK]);
-      Compute(FETL(this),Src,Y);
+      if(spectrum == 1)
+        ShellCompute(FETL(this),Src,Y);
+      else
+        ShellCompute(FTL(this),Src,Y);
     } else
       Compute(FL(this),Src,Y);
   }
@@ -505,33 +1142,82 @@ public:
     }
   }
 
+  // Instantaneous energy spectrum of the ensemble, for spectrum=2.
+  void InstantaneousSpectrum(const vector2& Y, const vector& ek) {
+    Set(E,ek);
+    for(unsigned K=0; K < nshells; K++)
+      E[K]=0.0;
+    for(unsigned e=0; e < ensemble; ++e) {
+      w.Set(Y[OMEGA]+e*nmode);
+      ShellLoop(Initw(this),FE(this));
+    }
+    w.Set(Y[OMEGA]);
+  }
+
+  // Like Loop, but also pass the shell index K of each mode to fcn.
+  template<class S, class T>
+  void ShellLoop(S init, T fcn)
+  {
+    Vector wi,Si;
+    unsigned r=0;
+    for(int i=-mx+1; i < mx; ++i, ++r) {
+      init(wi,Si,i);
+      const ShellRun *stop=shells.end(r);
+      for(const ShellRun *R=shells.begin(r); R < stop; ++R) {
+        unsigned K=R->K;
+        for(unsigned j=R->start; j < R->stop; ++j)
+          fcn(wi,Si,i,j,K);
+      }
+    }
+  }
+
   template<class T>
   void Compute(T fcn, const vector2& Src, const vector2& Y)
   {
-    S.Set(Src[OMEGA]);
-    w.Set(Y[OMEGA]);
+    for(unsigned e=0; e < ensemble; ++e) {
+      S.Set(Src[OMEGA]+e*nmode);
+      w.Set(Y[OMEGA]+e*nmode);
+      Loop(InitwS(this),fcn);
+    }
+  }
 
-    Loop(InitwS(this),fcn);
+  template<class T>
+  void ShellCompute(T fcn, const vector2& Src, const vector2& Y)
+  {
+    for(unsigned e=0; e < ensemble; ++e) {
+      S.Set(Src[OMEGA]+e*nmode);
+      w.Set(Y[OMEGA]+e*nmode);
+      ShellLoop(InitwS(this),fcn);
+    }
   }
 
   void Stochastic(const vector2&Y, double, double dt)
   {
+    if(nscalars) ScalarStochastic(Y,dt);
     if(!Forcing->Stochastic(dt)) return;
-    w.Set(Y[OMEGA]);
 
-    if(spectrum == 0) {
-      Loop(Initw(this),ForceStochasticNO(this));
-    } else {
+    if(spectrum) {
       Set(Eps,Y[EPS]);
       Set(Eta,Y[ETA]);
       Set(Zeta,Y[ZETA]);
-      Loop(Initw(this),ForceStochastic(this));
     }
+
+    for(unsigned e=0; e < ensemble; ++e) {
+      w.Set(Y[OMEGA]+e*nmode);
+      if(spectrum == 0)
+        Loop(Initw(this),ForceStochasticNO(this));
+      else
+        ShellLoop(Initw(this),ForceStochastic(this));
+    }
+    w.Set(Y[OMEGA]);
   }
 
+  // Each ensemble member stores its modes in rows i=-mx+1,...,mx-1.
   Nu LinearCoeff(unsigned k) {
-    unsigned i=k/my;
-    unsigned j=k-my*i;
+    k %= nmode;
+    unsigned row=k/my;
+    int i=row-(mx-1);
+    int j=k-my*row;
     return nuk(i*i+j*j);
   }
 
@@ -542,31 +1228,46 @@ public:
     return diss;
   }
 
-  virtual void ComputeInvariants(const array2<Complex> &w, Real& E, Real& Z,
+  virtual void ComputeInvariants(const Array2<Complex>& w, Real& E, Real& Z,
                                  Real& P) {
-    Energy=Enstrophy=Palinstrophy=0.0;
-
-    Loop(Initw(this),Invariants(this));
+#pragma omp parallel for num_threads(threads)
+    for(int i=-mx+1; i < mx; ++i) {
+      Vector wi=w[i];
+      rVector k2invi=k2inv[i];
+      Real i2=i*i;
+      Real e=0.0, z=0.0, p=0.0;
+      for(int j=i <= 0 ? 1 : 0; j < my; ++j) {
+        Real w2=abs2(wi[j]);
+        z += w2;
+        e += w2*k2invi[j];
+        p += (i2+j*j)*w2;
+      }
+      Real *s=invariants[i+mx-1];
+      s[0]=e;
+      s[1]=z;
+      s[2]=p;
+    }
 
-    E=Energy;
-    Z=Enstrophy;
-    P=Palinstrophy;
+    unsigned n=2*mx-1;
+    E=sum(invariants(),n,3);
+    Z=sum(invariants()+1,n,3);
+    P=sum(invariants()+2,n,3);
   }
 
   virtual Real getSpectrum(unsigned i) {
     double c=count[i];
-    return c > 0 ? E[i].re*twopi/c : 0.0;
-  }
-  Real TE_(unsigned i) {return TE[i].re;}
-  Real TZ_(unsigned i) {return TZ[i].re;}
-  Real Eps_(unsigned i) {return Eps[i].re;}
-  Real Eta_(unsigned i) {return Eta[i].re;}
-  Real Zeta_(unsigned i) {return Zeta[i].re;}
-  Real DE_(unsigned i) {return DE[i].re;}
-  Real DZ_(unsigned i) {return DZ[i].re;}
-
-  Real kb(unsigned i) {return i+0.5;}
-  Real kc(unsigned i) {return i+1;}
+    return c > 0 ? E[i].re*twopi*Minv/c : 0.0;
+  }
+  Real TE_(unsigned i) {return TE[i].re*Minv;}
+  Real TZ_(unsigned i) {return TZ[i].re*Minv;}
+  Real Eps_(unsigned i) {return Eps[i].re*Minv;}
+  Real Eta_(unsigned i) {return Eta[i].re*Minv;}
+  Real Zeta_(unsigned i) {return Zeta[i].re*Minv;}
+  Real DE_(unsigned i) {return DE[i].re*Minv;}
+  Real DZ_(unsigned i) {return DZ[i].re*Minv;}
+
+  Real kb(unsigned i) {return ::kb(i);}
+  Real kc(unsigned i) {return ::kc(i);}
 };
 
 extern InitialConditionBase *InitialCondition;
@@ -0,0 +1,340 @@
+#ifndef __dnsdata_h__
+#define __dnsdata_h__ 1
+
+// Random access to the output of dns through read-only memory maps:
+//
+//   FrameFile    w, vx, vy: movie frames (int nz, ny, nx; float[nx*ny*nz])
+//   ModalFile    ek: modal energies (int 2*mx-1, my; double[(2*mx-1)*my])
+//   CurveFile    ekvk/t<n>, transfer/t<n>: out_curve data (int n; double[n])
+//   CurveSeries  the numbered files of ekvk/ or transfer/
+//   Table        evt, t: whitespace-separated text columns
+//
+// The binary files are xdr, i.e. big-endian. Records are addressed in
+// place in the mapping: single values are converted on access and whole
+// records are converted in bulk by Decode, so nothing is copied or parsed
+// until it is used. ParallelFor visits records on several threads; the
+// mappings are read-only and may be shared freely.
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace dnsdata {
+
+inline bool BigEndian()
+{
+  const uint32_t one=1;
+  return *(const unsigned char *) &one == 0;
+}
+
+inline uint32_t swap32(uint32_t x)
+{
+#ifdef __GNUC__
+  return __builtin_bswap32(x);
+#else
+  return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+#endif
+}
+
+inline uint64_t swap64(uint64_t x)
+{
+#ifdef __GNUC__
+  return __builtin_bswap64(x);
+#else
+  return ((uint64_t) swap32((uint32_t) x) << 32) | swap32((uint32_t) (x >> 32));
+#endif
+}
+
+// Convert the xdr value at p.
+inline void xdrvalue(const unsigned char *p, int& x)
+{
+  uint32_t y;
+  memcpy(&y,p,4);
+  if(!BigEndian()) y=swap32(y);
+  x=(int32_t) y;
+}
+
+inline void xdrvalue(const unsigned char *p, float& x)
+{
+  uint32_t y;
+  memcpy(&y,p,4);
+  if(!BigEndian()) y=swap32(y);
+  memcpy(&x,&y,4);
+}
+
+inline void xdrvalue(const unsigned char *p, double& x)
+{
+  uint64_t y;
+  memcpy(&y,p,8);
+  if(!BigEndian()) y=swap64(y);
+  memcpy(&x,&y,8);
+}
+
+// Convert the n xdr values at p into x. The swaps of the copied words
+// form a simple loop that the compiler vectorizes.
+inline void Decode(const unsigned char *p, float *x, size_t n)
+{
+  memcpy(x,p,4*n);
+  if(BigEndian()) return;
+  uint32_t *y=(uint32_t *) x;
+  for(size_t i=0; i < n; ++i)
+    y[i]=swap32(y[i]);
+}
+
+inline void Decode(const unsigned char *p, double *x, size_t n)
+{
+  memcpy(x,p,8*n);
+  if(BigEndian()) return;
+  uint64_t *y=(uint64_t *) x;
+  for(size_t i=0; i < n; ++i)
+    y[i]=swap64(y[i]);
+}
+
+// Call f(i) for i=0,...,n-1 on the given number of threads (0=default).
+// f is passed by value and shared by the threads.
+template<class F>
+void ParallelFor(size_t n, F f, unsigned threads=0)
+{
+#ifdef _OPENMP
+  if(threads == 0) threads=omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+  for(long i=0; i < (long) n; ++i)
+    f((size_t) i);
+}
+
+// A read-only memory map of a whole file.
+class MappedFile {
+  void *base;
+  size_t length;
+
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+public:
+  MappedFile() : base(NULL), length(0) {}
+
+  ~MappedFile() {Close();}
+
+  bool Open(const std::string& name) {
+    Close();
+    int fd=open(name.c_str(),O_RDONLY);
+    if(fd < 0) return false;
+    struct stat s;
+    if(fstat(fd,&s) == 0 && s.st_size > 0) {
+      void *p=mmap(NULL,s.st_size,PROT_READ,MAP_SHARED,fd,0);
+      if(p != MAP_FAILED) {
+        base=p;
+        length=s.st_size;
+      }
+    }
+    close(fd);
+    return base != NULL;
+  }
+
+  void Close() {
+    if(base) munmap(base,length);
+    base=NULL;
+    length=0;
+  }
+
+  const unsigned char *Data() const {return (const unsigned char *) base;}
+  size_t Size() const {return length;}
+};
+
+// A file of equal-sized records, each a header of nheader xdr ints whose
+// product is the number of values of type T that follow. A trailing
+// partial record, as left by a running job, is ignored.
+template<class T>
+class RecordFile {
+protected:
+  MappedFile map;
+  unsigned nheader;
+  std::vector<int> header;
+  size_t nvalues,recordsize,nrecords;
+
+  bool Open(const std::string& name, unsigned n) {
+    nheader=n;
+    nrecords=0;
+    if(!map.Open(name) || map.Size() < 4*nheader) return false;
+    header.resize(nheader);
+    nvalues=1;
+    for(unsigned i=0; i < nheader; ++i) {
+      xdrvalue(map.Data()+4*i,header[i]);
+      if(header[i] <= 0) return false;
+      nvalues *= header[i];
+    }
+    recordsize=4*nheader+sizeof(T)*nvalues;
+    nrecords=map.Size()/recordsize;
+    return true;
+  }
+public:
+  size_t Records() const {return nrecords;}
+  size_t Values() const {return nvalues;}
+
+  // The xdr values of record r, in place.
+  const unsigned char *Data(size_t r) const {
+    return map.Data()+r*recordsize+4*nheader;
+  }
+
+  T Value(size_t r, size_t i) const {
+    T x;
+    xdrvalue(Data(r)+sizeof(T)*i,x);
+    return x;
+  }
+
+  // Convert record r into x[0...Values()).
+  void Decode(size_t r, T *x) const {dnsdata::Decode(Data(r),x,nvalues);}
+};
+
+// Movie frames, stored top row first.
+class FrameFile : public RecordFile<float> {
+public:
+  bool Open(const std::string& name) {return RecordFile<float>::Open(name,3);}
+
+  unsigned Nx() const {return header[2];}
+  unsigned Ny() const {return header[1];}
+
+  // Value of frame r at (x,y)=(i,j), with j=0 at the bottom.
+  float operator()(size_t r, unsigned i, unsigned j) const {
+    return Value(r,(size_t) (Ny()-1-j)*Nx()+i);
+  }
+};
+
+// Modal energies of the half plane, i in (-mx,mx) by j in [0,my).
+class ModalFile : public RecordFile<double> {
+public:
+  bool Open(const std::string& name) {return RecordFile<double>::Open(name,2);}
+
+  int mx() const {return (header[0]+1)/2;}
+  int my() const {return header[1];}
+
+  double operator()(size_t r, int i, int j) const {
+    return Value(r,(size_t) (i+mx()-1)*my()+j);
+  }
+};
+
+// The curves written by out_curve to one file, each an xdr int n followed
+// by n doubles. The first curve of the ekvk and transfer files is the time.
+class CurveFile {
+  MappedFile map;
+  std::vector<size_t> offset;
+  std::vector<unsigned> length;
+public:
+  bool Open(const std::string& name) {
+    offset.clear();
+    length.clear();
+    if(!map.Open(name)) return false;
+    size_t size=map.Size();
+    size_t pos=0;
+    while(pos+4 <= size) {
+      int n;
+      xdrvalue(map.Data()+pos,n);
+      pos += 4;
+      if(n < 0 || pos+8*(size_t) n > size) return false;
+      offset.push_back(pos);
+      length.push_back(n);
+      pos += 8*(size_t) n;
+    }
+    return pos == size;
+  }
+
+  unsigned Curves() const {return offset.size();}
+  unsigned Length(unsigned c) const {return length[c];}
+
+  double operator()(unsigned c, unsigned i) const {
+    double x;
+    xdrvalue(map.Data()+offset[c]+8*i,x);
+    return x;
+  }
+
+  double Time() const {return (*this)(0,0);}
+
+  void Decode(unsigned c, double *x) const {
+    dnsdata::Decode(map.Data()+offset[c],x,length[c]);
+  }
+};
+
+// The files t0, t1, ... of an output directory such as ekvk or transfer.
+class CurveSeries {
+  std::string prefix;
+  size_t n;
+public:
+  CurveSeries(const std::string& run, const std::string& dir) :
+    prefix(run+"/"+dir+"/t"), n(0) {
+    struct stat s;
+    while(stat(Name(n).c_str(),&s) == 0) ++n;
+  }
+
+  size_t Files() const {return n;}
+
+  std::string Name(size_t i) const {
+    std::ostringstream buf;
+    buf << prefix << i;
+    return buf.str();
+  }
+
+  bool Open(size_t i, CurveFile& c) const {return c.Open(Name(i));}
+};
+
+// Numeric text columns, skipping lines that begin with #. The number of
+// columns is set by the first data row.
+class Table {
+  std::vector<std::vector<double> > columns;
+public:
+  bool Open(const std::string& name) {
+    columns.clear();
+    MappedFile map;
+    if(!map.Open(name)) return false;
+    const char *p=(const char *) map.Data();
+    const char *end=p+map.Size();
+    std::vector<double> row;
+    while(p < end) {
+      const char *eol=(const char *) memchr(p,'\n',end-p);
+      if(!eol) eol=end;
+      row.clear();
+      if(*p != '#') {
+        const char *q=p;
+        while(q < eol) {
+          while(q < eol && (*q == ' ' || *q == '\t' || *q == '\r')) ++q;
+          const char *token=q;
+          while(q < eol && *q != ' ' && *q != '\t' && *q != '\r') ++q;
+          if(q > token) {
+            char buf[64];
+            size_t n=q-token < 63 ? q-token : 63;
+            memcpy(buf,token,n);
+            buf[n]=0;
+            row.push_back(strtod(buf,NULL));
+          }
+        }
+      }
+      if(!row.empty()) {
+        if(columns.empty()) columns.resize(row.size());
+        if(row.size() >= columns.size())
+          for(size_t c=0; c < columns.size(); ++c)
+            columns[c].push_back(row[c]);
+      }
+      p=eol+1;
+    }
+    return true;
+  }
+
+  size_t Columns() const {return columns.size();}
+  size_t Rows() const {return columns.empty() ? 0 : columns[0].size();}
+
+  const std::vector<double>& operator[](size_t c) const {return columns[c];}
+};
+
+}
+
+#endif
@@ -0,0 +1,188 @@
+// Text dump of the output of dns, read through dnsdata.h.
+//
+// Usage: dnsread run [file [n]]
+//
+// Without a file, the number of records in each output of run is listed.
+// file is one of w, vx, vy, ek, ekvk, transfer, shells (protodns3), evt,
+// or t. For the frame files and ek, n selects the record and defaults to
+// the last; for ekvk, transfer, and shells, n selects the file t<n> and
+// defaults to the last. Negative values of n count back from the end.
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include "dnsdata.h"
+
+using namespace std;
+using namespace dnsdata;
+
+string run;
+
+// Resolve a record number given on the command line.
+bool record(int argc, char *argv[], size_t count, size_t& r)
+{
+  if(count == 0) return false;
+  long n=argc > 3 ? atol(argv[3]) : -1;
+  if(n < 0) n += count;
+  if(n < 0 || n >= (long) count) return false;
+  r=n;
+  return true;
+}
+
+void frame(const string& name, int argc, char *argv[])
+{
+  FrameFile f;
+  size_t r;
+  if(!f.Open(run+"/"+name) || !record(argc,argv,f.Records(),r)) {
+    cerr << "Cannot read " << name << endl;
+    exit(1);
+  }
+  unsigned nx=f.Nx(), ny=f.Ny();
+  vector<float> v(f.Values());
+  f.Decode(r,&v[0]);
+  for(unsigned j=0; j < ny; ++j) {
+    const float *row=&v[(size_t) j*nx];
+    for(unsigned i=0; i < nx; ++i)
+      cout << (i ? "\t" : "") << row[i];
+    cout << "\n";
+  }
+}
+
+void modal(int argc, char *argv[])
+{
+  ModalFile f;
+  size_t r;
+  if(!f.Open(run+"/ek") || !record(argc,argv,f.Records(),r)) {
+    cerr << "Cannot read ek" << endl;
+    exit(1);
+  }
+  int mx=f.mx(), my=f.my();
+  vector<double> v(f.Values());
+  f.Decode(r,&v[0]);
+  for(int i=-mx+1; i < mx; ++i) {
+    const double *row=&v[(size_t) (i+mx-1)*my];
+    cout << i;
+    for(int j=0; j < my; ++j)
+      cout << "\t" << row[j];
+    cout << "\n";
+  }
+}
+
+void curves(const char *dir, int argc, char *argv[])
+{
+  CurveSeries series(run,dir);
+  CurveFile f;
+  size_t r;
+  if(!record(argc,argv,series.Files(),r) || !series.Open(r,f)) {
+    cerr << "Cannot read " << dir << endl;
+    exit(1);
+  }
+  cout << "# t=" << f.Time() << "\n";
+  unsigned n=0;
+  for(unsigned c=1; c < f.Curves(); ++c)
+    if(f.Length(c) > n) n=f.Length(c);
+  for(unsigned K=0; K < n; ++K) {
+    cout << K;
+    for(unsigned c=1; c < f.Curves(); ++c) {
+      cout << "\t";
+      if(K < f.Length(c)) cout << f(c,K);
+    }
+    cout << "\n";
+  }
+}
+
+void table(const string& name)
+{
+  Table T;
+  if(!T.Open(run+"/"+name)) {
+    cerr << "Cannot read " << name << endl;
+    exit(1);
+  }
+  for(size_t r=0; r < T.Rows(); ++r) {
+    for(size_t c=0; c < T.Columns(); ++c)
+      cout << (c ? "\t" : "") << T[c][r];
+    cout << "\n";
+  }
+}
+
+// Read the time of each file of a series; unreadable files are marked.
+struct SeriesTimes {
+  const CurveSeries& series;
+  vector<double>& t;
+  vector<char>& ok;
+  SeriesTimes(const CurveSeries& series, vector<double>& t,
+              vector<char>& ok) : series(series), t(t), ok(ok) {}
+  void operator()(size_t i) const {
+    CurveFile f;
+    ok[i]=series.Open(i,f) && f.Curves() > 0;
+    t[i]=ok[i] ? f.Time() : 0.0;
+  }
+};
+
+void summary()
+{
+  const char *frames[]={"w","vx","vy"};
+  for(unsigned i=0; i < 3; ++i) {
+    FrameFile f;
+    if(f.Open(run+"/"+frames[i]))
+      cout << frames[i] << "\t" << f.Records() << " frames of "
+           << f.Nx() << "x" << f.Ny() << endl;
+  }
+  ModalFile ek;
+  if(ek.Open(run+"/ek"))
+    cout << "ek\t" << ek.Records() << " records of " << 2*ek.mx()-1 << "x"
+         << ek.my() << endl;
+  const char *dirs[]={"ekvk","transfer","shells"};
+  for(unsigned i=0; i < 3; ++i) {
+    CurveSeries series(run,dirs[i]);
+    size_t n=series.Files();
+    if(n == 0) continue;
+    vector<double> t(n);
+    vector<char> ok(n);
+    ParallelFor(n,SeriesTimes(series,t,ok));
+    size_t bad=0;
+    for(size_t j=0; j < n; ++j)
+      if(!ok[j]) ++bad;
+    cout << dirs[i] << "\t" << n << " files, t=" << t[0] << "..." << t[n-1];
+    if(bad) cout << " (" << bad << " unreadable)";
+    cout << endl;
+  }
+  const char *tables[]={"evt","t"};
+  for(unsigned i=0; i < 2; ++i) {
+    Table T;
+    if(T.Open(run+"/"+tables[i]))
+      cout << tables[i] << "\t" << T.Rows() << " rows" << endl;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 2) {
+    cerr << "Usage: " << argv[0] << " run [file [n]]" << endl;
+    return 1;
+  }
+
+  run=argv[1];
+  cout << setprecision(17);
+
+  if(argc < 3) {
+    summary();
+    return 0;
+  }
+
+  string name=argv[2];
+  if(name == "w" || name == "vx" || name == "vy") frame(name,argc,argv);
+  else if(name == "ek") modal(argc,argv);
+  else if(name == "ekvk" || name == "transfer" || name == "shells")
+    curves(name.c_str(),argc,argv);
+  else if(name == "evt" || name == "t") table(name);
+  else {
+    cerr << "Unknown file " << name << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,654 @@
+#include "dns.h"
+
+const double ProblemVersion=1.0;
+
+#if !COMPLEX
+#error MDNS requires COMPLEX=1 in options.h
+#endif
+
+using namespace utils;
+
+const char *problem="Multi-Grid Direct Numerical Simulation of Turbulence";
+
+const char *method="MDNS";
+const char *integrator="RK5";
+const char *ic="Equipartition";
+const char *forcing="WhiteNoiseBanded";
+
+// Spectral reduction (Bowman, Shadwick & Morrison, PRL 83, 5491, 1999):
+//
+// Grid g has the same (Nx,Ny) modes as grid 0 but wavenumber spacing
+// radix^g; each of its modes represents the mean of a radix x radix bin of
+// modes of grid g-1. Bins of grid g lying entirely inside grid g-1 are
+// hidden: project sets them to the mean of the finer modes before every
+// source evaluation. The outer ring of hidden bins carries the interactions
+// of grid g-1 with the wavenumbers beyond it: prolong corrects the mean
+// source of each finer bin in that ring to the coarse source.
+//
+// All grids share one convolution and its work arrays. The radix is odd so
+// that bins are centered on coarse modes and conjugate bins map onto
+// conjugate bins.
+
+// Vocabulary
+Real nuH=0.0, nuL=0.0;
+Real kH=0.0, kL=0.0;
+int pH=1;
+int pL=0;
+unsigned Nx=255;
+unsigned Ny=255;
+unsigned ngrids=2;
+unsigned radix=3;
+Real eta=0.0;
+Complex force=0.0;
+Real kforce=1.0;
+Real deltaf=1.0;
+unsigned spectra=1;
+Real icalpha=1.0;
+Real icbeta=1.0;
+int randomIC=0;
+unsigned seed=0;
+
+// Features of DNSBase that are not available on the reduced grids
+unsigned spectrum=0;
+unsigned movie=0;
+unsigned capture=0;
+unsigned images=0;
+unsigned imagestride=1;
+unsigned ensemble=1;
+unsigned physical=0;
+unsigned pdfbins=0;
+Real pdfrange=5.0;
+
+class MDNS : public DNSBase, public ProblemBase {
+  int h; // Half width of a bin
+  int hx,hy; // Hidden coarse modes: |I| <= hx, J <= hy
+  int cx,cy; // Finer modes covered by the hidden bins: |i| <= cx, j <= cy
+  Real binnorm;
+  Real *scale; // Wavenumber spacing of each grid
+  Real *weight; // Number of grid 0 modes represented by a mode of each grid
+
+  Array2<Complex> wf,wc; // Finer and coarser grids of project and prolong
+
+  unsigned ns; // Number of shells per grid
+  Array1<Real>::opt ekg,kg;
+  uvector countg;
+
+public:
+  MDNS();
+  ~MDNS();
+
+  void InitialConditions();
+  void Initialize();
+
+  void Output(int);
+  void FinalOutput();
+
+  void IndexLimits(unsigned& start, unsigned& stop,
+		   unsigned& startT, unsigned& stopT,
+		   unsigned& startM, unsigned& stopM) {
+    start=Start(OMEGA);
+    stop=Stop(OMEGA);
+    startT=Start(TRANSFERE);
+    stopT=Stop(DISSIPATIONZ);
+    startM=Start(EK);
+    stopM=Stop(EK);
+  }
+
+  // Mode (i,j) of the half plane, or the conjugate of its mirror image.
+  static Complex Mode(const Array2<Complex>& f, int i, int j) {
+    return j > 0 || (j == 0 && i >= 0) ? f(i,j) : conj(f(-i,-j));
+  }
+
+  Complex BinMean(const Array2<Complex>& f, int I, int J) {
+    int i0=radix*I;
+    int j0=radix*J;
+    Complex sum=0.0;
+    for(int a=-h; a <= h; ++a)
+      for(int b=-h; b <= h; ++b)
+        sum += Mode(f,i0+a,j0+b);
+    return binnorm*sum;
+  }
+
+  bool Hidden(unsigned g, int i, int j) {
+    return g > 0 && abs(i) <= hx && j <= hy;
+  }
+
+  // Modes of grid g counted in the diagnostics: each wavenumber belongs to
+  // the finest grid that covers it.
+  bool Owned(unsigned g, int i, int j) {
+    if(g+1 < ngrids && (abs(i) > cx || j > cy)) return false;
+    return !Hidden(g,i,j);
+  }
+
+  void Project(const vector2& Y);
+  void Prolong(const vector2& Src);
+
+  void Source(const vector2& Src, const vector2& Y, double t);
+
+  void Stochastic(const vector2&Y, double, double dt) {
+    if(!Forcing->Stochastic(dt)) return;
+    w.Set(Y[OMEGA]);
+    Loop(Initw(this),ForceStochasticNO(this));
+  }
+
+  void Invariants(Real& E, Real& Z, Real& P);
+  void Spectra();
+};
+
+MDNS *MDNSProblem;
+
+void multcapture2(double **F, unsigned int m,
+                  const unsigned int indexsize,
+                  const unsigned int *index,
+                  unsigned int r, unsigned int threads)
+{
+  MDNSProblem->PhysicalSpace(F,m,index[0],r,true);
+  multadvection2(F,m,indexsize,index,r,threads);
+}
+
+void multensemble2(double **F, unsigned int m,
+                   const unsigned int indexsize,
+                   const unsigned int *index,
+                   unsigned int r, unsigned int threads)
+{
+  multadvection2(F,m,indexsize,index,r,threads);
+}
+
+void multscalar2(double **F, unsigned int m,
+                 const unsigned int indexsize,
+                 const unsigned int *index,
+                 unsigned int r, unsigned int threads)
+{
+  multadvection2(F,m,indexsize,index,r,threads);
+}
+
+void multphysical2(double **F, unsigned int m,
+                   const unsigned int indexsize,
+                   const unsigned int *index,
+                   unsigned int r, unsigned int threads)
+{
+  MDNSProblem->PhysicalSpace(F,m,index[0],r,false);
+  multadvection2(F,m,indexsize,index,r,threads);
+}
+
+InitialConditionBase *InitialCondition;
+ForcingBase *Forcing;
+
+class Zero : public InitialConditionKernel<Zero> {
+public:
+  const char *Name() {return "Zero";}
+
+  Var Value(Real,Real,Real) {return 0.0;}
+};
+
+class Equipartition : public InitialConditionKernel<Equipartition> {
+public:
+  const char *Name() {return "Equipartition";}
+
+  Var Value(Real kx, Real ky, Real u) {
+    Real k2=kx*kx+ky*ky;
+    Real k=sqrt(k2);
+    Real v=icalpha+icbeta*k2;
+    v=v ? k*sqrt(2.0/v) : 0.0;
+    return randomIC ? v*expi(twopi*u) : v*sqrt(0.5)*Complex(1,1);
+  }
+};
+
+class Power : public InitialConditionKernel<Power> {
+public:
+  const char *Name() {return "Power";}
+
+  Var Value(Real kx, Real ky, Real u) {
+    Real k2=kx*kx+ky*ky;
+    Real v=icbeta*pow(k2,-0.5*icalpha);
+    return randomIC ? v*expi(twopi*u) : v;
+  }
+};
+
+// forcing (on grid 0 only)
+class None : public ForcingBase {
+};
+
+class ConstantBanded : public ForcingBase {
+protected:
+  double K1,K2;
+public:
+  const char *Name() {return "Constant Banded";}
+
+  void Init() {
+    double h=0.5*deltaf;
+    K1=kforce-h;
+    K1 *= K1;
+    K2=kforce+h;
+    K2 *= K2;
+  }
+
+  bool active(int i, int j) {
+    int k=i*i+j*j;
+    return K1 < k && k < K2;
+  }
+
+  double Force(Complex& w, Complex& S, int i, int j) {
+    if(active(i,j)) {
+      S += force;
+      return realproduct(force,w);
+    }
+    return 0.0;
+  }
+};
+
+class WhiteNoiseBanded : public ConstantBanded {
+  Complex f0;
+  Real etanorm;
+public:
+  const char *Name() {return "White-Noise Banded";}
+
+  void Init(unsigned fcount) {
+    etanorm=1.0/((Real) fcount);
+  }
+
+  bool Stochastic(double dt) {
+    f0=sqrt(2.0*dt*eta*etanorm);
+    return true;
+  }
+
+  double ForceStochastic(Complex& w, int i, int j) {
+    if(active(i,j)) {
+      Complex f=f0*crand_gauss();
+      double eta=realproduct(f,w)+0.5*abs2(f);
+      w += f;
+      return eta;
+    }
+    return 0.0;
+  }
+};
+
+class MDNSVocabulary : public VocabularyBase {
+public:
+  const char *Name() {return problem;}
+  const char *Abbrev() {return "MDNS";}
+  MDNSVocabulary();
+
+  Table<InitialConditionBase> *InitialConditionTable;
+  InitialConditionBase *NewInitialCondition(const char *& key) {
+    return InitialConditionTable->Locate(key);
+  }
+
+  Table<ForcingBase> *ForcingTable;
+  ForcingBase *NewForcing(const char *& key) {
+    return ForcingTable->Locate(key);
+  }
+};
+
+MDNSVocabulary MDNS_Vocabulary;
+
+MDNSVocabulary::MDNSVocabulary()
+{
+  Vocabulary=this;
+
+  VOCAB_NOLIMIT(ic,"Initial Condition");
+  VOCAB(Nx,1,INT_MAX,"Number of dealiased modes in x direction");
+  VOCAB(Ny,1,INT_MAX,"Number of dealiased modes in y direction");
+  VOCAB(ngrids,1,INT_MAX,"Number of grids");
+  VOCAB(radix,3,INT_MAX,"Odd ratio of the wavenumber spacings of successive grids");
+  VOCAB(spectra,0,1,"Output energy spectra of each grid? (0=no, 1=yes)");
+
+  METHOD(MDNS);
+
+  InitialConditionTable=new Table<InitialConditionBase>("initial condition");
+  VOCAB(icalpha,0.0,0.0,"initial condition parameter");
+  VOCAB(icbeta,0.0,0.0,"initial condition parameter");
+  VOCAB(randomIC,0,1,"randomize the initial conditions?");
+  VOCAB(seed,0,0,"random seed for the initial conditions");
+  INITIALCONDITION(Zero);
+  INITIALCONDITION(Equipartition);
+  INITIALCONDITION(Power);
+
+  VOCAB(nuH,0.0,REAL_MAX,"High-wavenumber viscosity");
+  VOCAB(nuL,0.0,REAL_MAX,"Low-wavenumber viscosity");
+  VOCAB(kL,0.0,STD_MAX,"Restrict low wavenumber dissipation to [1,kL]");
+  VOCAB(kH,0.0,STD_MAX,"Restrict high wavenumber dissipation to [kH,infinity)");
+  VOCAB(pH,0,0,"Power of Laplacian for high-wavenumber viscosity");
+  VOCAB(pL,0,0,"Power of Laplacian for molecular viscosity");
+
+  VOCAB_NOLIMIT(forcing,"Forcing type");
+  ForcingTable=new Table<ForcingBase>("forcing");
+
+  VOCAB(eta,0.0,REAL_MAX,"vorticity injection rate");
+  VOCAB(force,(Complex) 0.0, (Complex) 0.0,"constant external force");
+  VOCAB(kforce,0.0,REAL_MAX,"forcing wavenumber");
+  VOCAB(deltaf,0.0,REAL_MAX,"forcing band width");
+  FORCING(None);
+  FORCING(ConstantBanded);
+  FORCING(WhiteNoiseBanded);
+}
+
+MDNS::MDNS()
+{
+  MDNSProblem=this;
+  check_compatibility(DEBUG);
+  LowStorageIntegrators(MDNS_Vocabulary.IntegratorTable,this);
+}
+
+MDNS::~MDNS()
+{
+  deleteAlign(block);
+  delete[] weight;
+  delete[] scale;
+}
+
+void MDNS::Initialize()
+{
+  DNSBase::Initialize();
+}
+
+void MDNS::InitialConditions()
+{
+  fftw::maxthreads=threads;
+
+  Nx=::Nx;
+  Ny=::Ny;
+  nuH=::nuH;
+  nuL=::nuL;
+  seed=::seed;
+  kH2=kH*kH;
+  kL2=kL*kL;
+
+  if(Nx % 2 == 0 || Ny % 2 == 0) msg(ERROR,"Nx and Ny must be odd");
+  if(radix % 2 == 0) msg(ERROR,"radix must be odd");
+
+  mx=(Nx+1)/2;
+  my=(Ny+1)/2;
+
+  h=(radix-1)/2;
+  hx=(mx-1-h)/(int) radix;
+  hy=(my-1-h)/(int) radix;
+  cx=radix*hx+h;
+  cy=radix*hy+h;
+  if(ngrids > 1 && (hx < 1 || hy < 1))
+    msg(ERROR,"Nx and Ny must exceed 3*radix");
+  binnorm=1.0/(radix*radix);
+
+  scale=new Real[ngrids];
+  weight=new Real[ngrids];
+  Real d=1.0;
+  for(unsigned g=0; g < ngrids; ++g) {
+    scale[g]=d;
+    weight[g]=d*d;
+    d *= radix;
+  }
+
+  ostringstream size;
+  size << Nx << "x" << Ny;
+  SetWisdom("mdns",size.str(),threads);
+
+  nshells=0;
+  NY[PAD]=my;
+  nmode=Nx*my;
+  Minv=1.0;
+
+  NY[OMEGA]=ngrids*nmode;
+  nscalars=0;
+  for(unsigned f=TRANSFERE; f <= SCALAR; ++f)
+    NY[f]=0;
+
+  cout << "\nGEOMETRY: " << ngrids << " X (" << Nx << " X " << Ny << ")"
+       << endl;
+  cout << "\nALLOCATING FFT BUFFERS" << endl;
+  size_t align=sizeof(Complex);
+
+  Allocator(align);
+
+  w.Dimension(Nx,my,-mx+1,0);
+  S.Dimension(Nx,my,-mx+1,0);
+  wf.Dimension(Nx,my,-mx+1,0);
+  wc.Dimension(Nx,my,-mx+1,0);
+
+  // One set of work arrays serves every grid.
+  block=ComplexAlign((Nx+1)*my);
+  f0.Dimension(Nx+1,my,-mx,0);
+  f1.Dimension(Nx+1,my,block,-mx,0);
+
+  vector f=Y[PAD];
+  for(int j=0; j < my; ++j)
+    f1(j)=f[j]=0.0;
+
+  F=new Complex*[2];
+  F[1]=f1;
+  Convolution=new fftwpp::ImplicitHConvolution2(mx,my,false,true,2,2);
+
+  framedue=false;
+  physicaldue=false;
+  reductions=0;
+  moments=new Moments[threads];
+
+  if(spectra) {
+    ns=::nshells(mx,my);
+    Allocate(ekg,ngrids*ns);
+    Allocate(kg,ngrids*ns);
+    Allocate(countg,ngrids*ns);
+    for(unsigned g=0; g < ngrids; ++g)
+      for(unsigned K=0; K < ns; ++K)
+        kg[g*ns+K]=scale[g]*kc(K);
+  }
+
+  InitialCondition=MDNS_Vocabulary.NewInitialCondition(ic);
+  Forcing=MDNS_Vocabulary.NewForcing(forcing);
+
+  tcount=0;
+  if(restart) {
+    Real t0;
+    ftin.open(Vocabulary->FileName(dirsep,"t"));
+    while(ftin >> t0, ftin.good()) tcount++;
+    ftin.close();
+  }
+
+  open_output(ft,dirsep,"t");
+  open_output(fevt,dirsep,"evt");
+
+  if(!restart)
+    remove_dir(Vocabulary->FileName(dirsep,"ekvk"));
+  if(spectra)
+    mkdir(Vocabulary->FileName(dirsep,"ekvk"),0xFFFF);
+
+  errno=0;
+
+  w.Set(Y[OMEGA]);
+  DNSBase::InitialConditions();
+  for(unsigned g=1; g < ngrids; ++g) {
+    w.Set(Y[OMEGA]+g*nmode);
+    w[0][0]=0.0;
+    InitialCondition->Fill(w,mx,my,CounterRNG(seed,g),threads,scale[g]);
+  }
+  Project(Y);
+  w.Set(Y[OMEGA]);
+  DNSBase::SetParameters();
+}
+
+// Set the hidden modes of each coarser grid to the bin means of the grid
+// below it, from the finest grid up.
+void MDNS::Project(const vector2& Y)
+{
+  for(unsigned g=1; g < ngrids; ++g) {
+    wf.Set(Y[OMEGA]+(g-1)*nmode);
+    wc.Set(Y[OMEGA]+g*nmode);
+#pragma omp parallel for num_threads(threads)
+    for(int I=-hx; I <= hx; ++I) {
+      Vector wcI=wc[I];
+      for(int J=I <= 0 ? 1 : 0; J <= hy; ++J)
+        wcI[J]=BinMean(wf,I,J);
+    }
+  }
+}
+
+// Correct the mean nonlinear source of each finer bin in the outer ring of
+// the hidden region to the coarse source, from the coarsest grid down.
+void MDNS::Prolong(const vector2& Src)
+{
+  for(unsigned g=ngrids-1; g > 0; --g) {
+    wf.Set(Src[OMEGA]+(g-1)*nmode);
+    wc.Set(Src[OMEGA]+g*nmode);
+    for(int I=-hx; I <= hx; ++I) {
+      bool edge=I == -hx || I == hx;
+      for(int J=I <= 0 ? 1 : 0; J <= hy; ++J) {
+        if(!edge && J < hy) continue;
+        Complex c=wc(I,J)-BinMean(wf,I,J);
+        int i0=radix*I;
+        int j0=radix*J;
+        for(int a=-h; a <= h; ++a) {
+          int i=i0+a;
+          for(int b=-h; b <= h; ++b) {
+            int j=j0+b;
+            if(j > 0 || (j == 0 && i > 0)) wf(i,j) += c;
+            else wf(-i,-j) += conj(c);
+          }
+        }
+      }
+    }
+  }
+}
+
+void MDNS::Source(const vector2& Src, const vector2& Y, double)
+{
+  Project(Y);
+
+  // Each grid borrows the last row of the grid below it as the Nyquist row
+  // of its convolution, so the grids are advected from the coarsest down.
+  for(int g=ngrids-1; g >= 0; --g) {
+    Complex *src=Src[OMEGA]+g*nmode;
+    Complex *f=g > 0 ? src-my : (Complex *) Src[PAD];
+    w.Set(Y[OMEGA]+g*nmode);
+    Advection(f);
+    if(g > 0) {
+      Real W=weight[g];
+#pragma omp parallel for num_threads(threads)
+      for(unsigned k=0; k < nmode; ++k)
+        src[k] *= W;
+    }
+  }
+
+  Prolong(Src);
+
+  for(unsigned g=0; g < ngrids; ++g) {
+    w.Set(Y[OMEGA]+g*nmode);
+    S.Set(Src[OMEGA]+g*nmode);
+    Real d2=scale[g]*scale[g];
+#pragma omp parallel for num_threads(threads)
+    for(int i=-mx+1; i < mx; ++i) {
+      Vector wi=w[i];
+      Vector Si=S[i];
+      for(int j=i <= 0 ? 1 : 0; j < my; ++j) {
+        if(Hidden(g,i,j)) Si[j]=0.0;
+        else {
+          Complex wij=wi[j];
+          if(g == 0) Forcing->Force(wij,Si[j],i,j);
+          Si[j] -= nuk(d2*(i*i+j*j))*wij;
+        }
+      }
+    }
+  }
+  w.Set(Y[OMEGA]);
+}
+
+// Invariants of the owned modes of all grids. With integer wavenumbers on
+// each grid, a mode of grid g contributes weight[g] times its enstrophy and
+// weight[g]^2 times its palinstrophy; its energy is unscaled.
+void MDNS::Invariants(Real& E, Real& Z, Real& P)
+{
+  Sum Es,Zs,Ps;
+  unsigned n=2*mx-1;
+  for(unsigned g=0; g < ngrids; ++g) {
+    w.Set(Y[OMEGA]+g*nmode);
+#pragma omp parallel for num_threads(threads)
+    for(int i=-mx+1; i < mx; ++i) {
+      Vector wi=w[i];
+      rVector k2invi=k2inv[i];
+      Real i2=i*i;
+      Real e=0.0, z=0.0, p=0.0;
+      for(int j=i <= 0 ? 1 : 0; j < my; ++j) {
+        if(Owned(g,i,j)) {
+          Real w2=abs2(wi[j]);
+          z += w2;
+          e += w2*k2invi[j];
+          p += (i2+j*j)*w2;
+        }
+      }
+      Real *s=invariants[i+mx-1];
+      s[0]=e;
+      s[1]=z;
+      s[2]=p;
+    }
+    Real W=weight[g];
+    Es += sum(invariants(),n,3);
+    Zs += W*sum(invariants()+1,n,3);
+    Ps += W*W*sum(invariants()+2,n,3);
+  }
+  w.Set(Y[OMEGA]);
+  E=Es.value();
+  Z=Zs.value();
+  P=Ps.value();
+}
+
+// Energy spectrum of the owned modes of each grid, in shells of width
+// scale[g].
+void MDNS::Spectra()
+{
+  for(unsigned k=0; k < ngrids*ns; ++k) {
+    ekg[k]=0.0;
+    countg[k]=0;
+  }
+  for(unsigned g=0; g < ngrids; ++g) {
+    w.Set(Y[OMEGA]+g*nmode);
+    Real *e=(Real *) ekg+g*ns;
+    unsigned *c=(unsigned *) countg+g*ns;
+    Real dinv=1.0/scale[g];
+    for(int i=-mx+1; i < mx; ++i) {
+      Vector wi=w[i];
+      for(int j=i <= 0 ? 1 : 0; j < my; ++j) {
+        if(Owned(g,i,j)) {
+          unsigned k2=i*i+j*j;
+          unsigned K=shellindex(k2);
+          e[K] += abs2(wi[j])*dinv/sqrt(k2);
+          ++c[K];
+        }
+      }
+    }
+  }
+  for(unsigned k=0; k < ngrids*ns; ++k)
+    ekg[k]=countg[k] > 0 ? ekg[k]*twopi/countg[k] : 0.0;
+  w.Set(Y[OMEGA]);
+}
+
+void MDNS::Output(int)
+{
+  Real E,Z,P;
+  Invariants(E,Z,P);
+  fevt << t << "\t" << E << "\t" << Z << "\t" << P << endl;
+
+  if(spectra) {
+    Spectra();
+    ostringstream buf;
+    buf << "ekvk" << dirsep << "t" << tcount;
+    const string& s=buf.str();
+    open_output(fekvk,dirsep,s.c_str(),0);
+    out_curve(fekvk,t,"t");
+    out_curve(fekvk,(Real) ngrids,"ngrids");
+    out_curve(fekvk,(Real *) kg,"k",ngrids*ns);
+    out_curve(fekvk,(Real *) ekg,"Ek",ngrids*ns);
+    fekvk.close();
+    if(!fekvk) msg(ERROR,"Cannot write to file ekvk");
+  }
+
+  tcount++;
+  ft << t << endl;
+}
+
+void MDNS::FinalOutput()
+{
+  Real E,Z,P;
+  Invariants(E,Z,P);
+  cout << endl;
+  cout << "Energy = " << E << newl;
+  cout << "Enstrophy = " << Z << newl;
+  cout << "Palinstrophy = " << P << newl;
+}
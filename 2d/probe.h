@@ -0,0 +1,79 @@
+#ifndef __probe_h__
+#define __probe_h__ 1
+
+#include "Complex.h"
+
+// Time series of selected Fourier modes. Each step appends a record (t,
+// then the complex amplitudes of every probe) to an in-memory buffer,
+// which is written out as one binary block when it fills:
+//
+//   nrecords nprobes ncomponents ndims k[ndims*nprobes]
+//   {t {re im}[ncomponents*nprobes]}[nrecords]
+//
+// where k lists the wavenumbers of each probe and the amplitudes of a
+// record run over the components of each probe in turn. Blocks are
+// self-describing, so appending after a restart needs no header.
+
+class ProbeBuffer {
+  unsigned nprobes,ncomponents,ndims;
+  unsigned capacity,count;
+  unsigned n; // Amplitudes per record
+  int *k;
+  double *T;
+  Complex *Z;
+public:
+  ProbeBuffer() : nprobes(0), ncomponents(0), ndims(0), capacity(0),
+                  count(0), n(0) {}
+
+  ~ProbeBuffer() {
+    if(capacity) {
+      delete [] k;
+      delete [] T;
+      delete [] Z;
+    }
+  }
+
+  // Record ncomponents amplitudes of the modes with wavenumbers
+  // wavenumbers[ndims*p...ndims*(p+1)) for p=0,...,nprobes-1, buffering
+  // capacity steps.
+  void Allocate(unsigned nprobes, unsigned ncomponents, unsigned ndims,
+                const int *wavenumbers, unsigned capacity) {
+    this->nprobes=nprobes;
+    this->ncomponents=ncomponents;
+    this->ndims=ndims;
+    this->capacity=capacity;
+    count=0;
+    n=ncomponents*nprobes;
+    k=new int[ndims*nprobes];
+    for(unsigned i=0; i < ndims*nprobes; ++i)
+      k[i]=wavenumbers[i];
+    T=new double[capacity];
+    Z=new Complex[capacity*n];
+  }
+
+  // Start a record at time t and return the slots of its amplitudes.
+  Complex *Record(double t) {
+    T[count]=t;
+    return Z+n*count++;
+  }
+
+  bool Full() const {return count == capacity;}
+
+  template<class Stream>
+  void Flush(Stream& out) {
+    if(count == 0) return;
+    out << count << nprobes << ncomponents << ndims;
+    for(unsigned i=0; i < ndims*nprobes; ++i)
+      out << k[i];
+    for(unsigned r=0; r < count; ++r) {
+      out << T[r];
+      Complex *z=Z+n*r;
+      for(unsigned i=0; i < n; ++i)
+        out << z[i].re << z[i].im;
+    }
+    out.flush();
+    count=0;
+  }
+};
+
+#endif
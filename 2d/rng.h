@@ -0,0 +1,32 @@
+#ifndef __rng_h__
+#define __rng_h__ 1
+
+#include <stdint.h>
+
+// Counter-based random numbers. Deviate n of a stream is a fixed hash of
+// (seed,stream,n) rather than the next state of a sequential generator, so
+// deviates can be drawn in any order and on any thread with identical
+// results.
+
+// SplitMix64 finalizer, a bijective 64-bit mixing function.
+inline uint64_t mix64(uint64_t x)
+{
+  x=(x^(x >> 30))*0xbf58476d1ce4e5b9ULL;
+  x=(x^(x >> 27))*0x94d049bb133111ebULL;
+  return x^(x >> 31);
+}
+
+class CounterRNG {
+  uint64_t key;
+public:
+  CounterRNG(uint64_t seed=0, uint64_t stream=0) :
+    key(mix64(mix64(seed)+stream)) {}
+
+  // Uniform deviate on [0,1) for counter n.
+  double uniform(uint64_t n) const {
+    return (mix64(key^mix64(n+0x9e3779b97f4a7c15ULL)) >> 11)*
+      (1.0/9007199254740992.0);
+  }
+};
+
+#endif
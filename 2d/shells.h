@@ -0,0 +1,113 @@
+#ifndef __shells_h__
+#define __shells_h__ 1
+
+#include <cmath>
+#include <cstddef>
+
+// Spectral shells: shell K contains the modes with K+0.5 <= |k| < K+1.5,
+// bounded by kb(K) and kb(K+1) and centered on kc(K).
+
+inline unsigned nshells(int mx, int my)
+{
+  return (unsigned) (hypot(mx-1,my-1)+0.5);
+}
+
+inline unsigned shellindex(unsigned k2)
+{
+  return (unsigned) (sqrt((double) k2)-0.5);
+}
+
+inline unsigned nshells(int mx, int my, int mz)
+{
+  return (unsigned) (sqrt((double) (mx-1)*(mx-1)+(my-1)*(my-1)+
+                          (mz-1)*(mz-1))+0.5);
+}
+
+inline double kb(unsigned K) {return K+0.5;}
+inline double kc(unsigned K) {return K+1;}
+
+// The modes of a row (fixed leading indices) with last index j in
+// [start,stop) all lie in shell K.
+struct ShellRun {
+  unsigned start,stop,K;
+};
+
+// Run-length shell decomposition of the stored half plane (2D) or half
+// space (3D) of Hermitian modes, built once per grid so that binning into
+// shells needs no square roots. Rows are numbered in loop order.
+class ShellIndex {
+  unsigned nrows,nruns;
+  unsigned *offsets; // Runs of row r: [offsets[r],offsets[r+1])
+  ShellRun *runs;
+
+  // Count (if runs=NULL) or store the runs of row r, which contains the
+  // modes i2+j*j for start <= j < stop.
+  void Row(unsigned& r, unsigned& n, unsigned i2, unsigned start,
+           unsigned stop) {
+    if(start < stop) {
+      unsigned K0=shellindex(i2+start*start);
+      for(unsigned j=start+1; j <= stop; ++j) {
+        unsigned K=j < stop ? shellindex(i2+j*j) : K0+1;
+        if(K != K0) {
+          if(runs) {
+            ShellRun& R=runs[n];
+            R.start=start;
+            R.stop=j;
+            R.K=K0;
+          }
+          ++n;
+          start=j;
+          K0=K;
+        }
+      }
+    }
+    if(runs) offsets[++r]=n;
+  }
+
+  void Clear() {
+    delete[] runs;
+    delete[] offsets;
+    runs=NULL;
+    offsets=NULL;
+  }
+
+public:
+  ShellIndex() : nrows(0), nruns(0), offsets(NULL), runs(NULL) {}
+  ~ShellIndex() {Clear();}
+
+  // Rows -mx < i < mx; j >= 1 for i <= 0.
+  void Allocate(int mx, int my) {
+    Clear();
+    for(unsigned pass=0; pass < 2; ++pass) {
+      unsigned r=0, n=0;
+      for(int i=-mx+1; i < mx; ++i)
+        Row(r,n,i*i,i <= 0 ? 1 : 0,my);
+      if(pass == 0) Dimension(2*mx-1,n);
+    }
+  }
+
+  // Rows -mx < i < mx, -my < j < my; k >= 1 for j < 0 or (j == 0, i <= 0).
+  void Allocate(int mx, int my, int mz) {
+    Clear();
+    for(unsigned pass=0; pass < 2; ++pass) {
+      unsigned r=0, n=0;
+      for(int i=-mx+1; i < mx; ++i)
+        for(int j=-my+1; j < my; ++j)
+          Row(r,n,i*i+j*j,(j < 0 || (j == 0 && i <= 0)) ? 1 : 0,mz);
+      if(pass == 0) Dimension((2*mx-1)*(2*my-1),n);
+    }
+  }
+
+  void Dimension(unsigned nrows0, unsigned nruns0) {
+    nrows=nrows0;
+    nruns=nruns0;
+    offsets=new unsigned[nrows+1];
+    runs=new ShellRun[nruns];
+    offsets[0]=0;
+  }
+
+  const ShellRun *begin(unsigned r) const {return runs+offsets[r];}
+  const ShellRun *end(unsigned r) const {return runs+offsets[r+1];}
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef __sum_h__
+#define __sum_h__ 1
+
+#include <cmath>
+
+// Compensated (Neumaier) summation. Modes are summed row by row into
+// plain partial sums, which vectorize and parallelize freely; the partials
+// are then combined in a fixed order with a correction term for the bits
+// lost in each addition, so results keep full precision and do not depend
+// on the number of threads.
+//
+// The correction cancels algebraically, so it must not be reassociated:
+// neumaier is compiled without -ffast-math where the compiler allows it.
+
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER)
+#define STRICTFP __attribute__((optimize("no-fast-math")))
+#else
+#define STRICTFP
+#endif
+
+// Add x to the sum s with correction c.
+STRICTFP inline void neumaier(double& s, double& c, double x)
+{
+  double t=s+x;
+  if(fabs(s) >= fabs(x)) c += (s-t)+x;
+  else c += (x-t)+s;
+  s=t;
+}
+
+class Sum {
+  double s,c;
+public:
+  Sum() : s(0.0), c(0.0) {}
+
+  void clear() {s=c=0.0;}
+
+  void add(double x) {neumaier(s,c,x);}
+
+  Sum& operator += (double x) {add(x); return *this;}
+
+  double value() const {return s+c;}
+};
+
+// Compensated sum of the n partial sums x[0], x[stride], ...
+inline double sum(const double *x, unsigned n, unsigned stride=1)
+{
+  Sum S;
+  for(unsigned i=0; i < n; ++i)
+    S.add(x[i*stride]);
+  return S.value();
+}
+
+#endif
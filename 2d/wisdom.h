@@ -0,0 +1,46 @@
+#ifndef __wisdom_h__
+#define __wisdom_h__ 1
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cctype>
+
+// FFTW wisdom is only valid for the transform sizes, thread count, and
+// processor it was measured on. Keying the wisdom file on all three lets
+// restarted or repeated runs import their plans instead of measuring them
+// again, while runs on other nodes or grids keep separate files.
+//
+// fftw++ loads fftw::WisdomName before its first plan and saves it after
+// planning, so the name must be set before any transform is constructed.
+
+inline std::string CPUName()
+{
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line,name;
+  while(getline(cpuinfo,line)) {
+    if(line.compare(0,10,"model name") == 0) {
+      size_t colon=line.find(':');
+      if(colon != std::string::npos) name=line.substr(colon+1);
+      break;
+    }
+  }
+  std::string key;
+  for(size_t i=0; i < name.size(); ++i)
+    if(isalnum(name[i])) key += name[i];
+  return key.empty() ? "cpu" : key;
+}
+
+// Set the wisdom file of a code for the given size (e.g. "1023x1023").
+inline void SetWisdom(const char *code, const std::string& size,
+                      unsigned threads)
+{
+  static std::string name;
+  std::ostringstream buf;
+  buf << "wisdom-" << code << "-" << size << "-" << threads << "-"
+      << CPUName() << ".txt";
+  name=buf.str();
+  fftwpp::fftw::WisdomName=name.c_str();
+}
+
+#endif
@@ -1,9 +1,17 @@
 #include <cmath>
 #include <iomanip>
 #include <fstream>
+#include <cstdlib>
 #include "Complex.h"
 #include "convolution.h"
 #include "Array.h"
+#include "shells.h"
+#include "sum.h"
+#include "wisdom.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 using namespace Array;
@@ -15,6 +23,14 @@ int Ny=1023; // Number of modes in y direction
 double dt=1.0e-6;
 double nu=0.0; // kinematic viscosity
 
+// Parareal: the n steps are split into slices, which are advanced in
+// parallel by the fine (dt) propagator and corrected serially by a coarse
+// propagator taking coarse steps per slice, until the energy and enstrophy
+// at the slice boundaries change by less than tolerance.
+int slices=0; // Number of time slices (0=serial time loop)
+int coarse=1; // Coarse steps per slice
+double tolerance=1.0e-10;
+
 int mx;
 int my;
 
@@ -22,11 +38,32 @@ typedef Array1<Complex>::opt vector;
 typedef Array2<Complex> vector2;
 
 vector2 w;
-vector2 f0,f1;
+Array2<double> k2inv;
 
 ofstream ezvt("ezvt",ios::out);
 
-ImplicitHConvolution2 *Convolution;
+// Work arrays and convolution of a propagator.
+struct Workspace {
+  unsigned threads;
+  vector2 f0,f1;
+  Array2<double> invariants; // Row partial sums of E, Z, and P
+  ImplicitHConvolution2 *Convolution;
+
+  void Allocate(unsigned threads=fftw::maxthreads) {
+    this->threads=threads;
+    size_t align=sizeof(Complex);
+    f0.Allocate(Nx,my,-mx+1,0,align);
+    f1.Allocate(Nx,my,-mx+1,0,align);
+    invariants.Allocate(Nx,3,-mx+1,0);
+    Convolution=new ImplicitHConvolution2(mx,my,true,true,2,2,threads);
+  }
+
+  void Deallocate() {
+    delete Convolution;
+  }
+};
+
+Workspace work;
 
 void init(vector2& w)
 {
@@ -39,8 +76,12 @@ void init(vector2& w)
   }
 }
     
-void Source(const vector2& w, vector2 &S)
+// Store dw/dt in W.f0.
+void Source(const vector2& w, Workspace& W)
 {
+  vector2& f0=W.f0;
+  vector2& f1=W.f1;
+
   f0[0][0]=0.0; // Enforce no mean flow.
   f1[0][0]=0.0;
   
@@ -64,7 +105,7 @@ void Source(const vector2& w, vector2 &S)
   Complex *F[]={f0,f1};
 
   // u_k, v_k -> F{v^2-u^2}_k, F{u*v}_k
-  Convolution->convolve(F,multadvection2);
+  W.Convolution->convolve(F,multadvection2);
   
   for(int i=-mx+1; i < mx; ++i) {
     vector wi=w[i];
@@ -78,43 +119,79 @@ void Source(const vector2& w, vector2 &S)
   }
 }
 
+// Advance w by n explicit Euler steps of size h.
+void Advance(vector2& w, int n, double h, Workspace& W)
+{
+  for(int step=0; step < n; ++step) {
+    Source(w,W);
+    for(int i=-mx+1; i < mx; ++i) {
+      vector wi=w[i];
+      vector f0i=W.f0[i];
+      for(int j=(i <= 0 ? 1 : 0); j < my; ++j)
+        wi[j] += f0i[j]*h;
+    }
+  }
+}
+
+ShellIndex shells;
+
 void Spectrum()
 {
   ofstream zkvk("zkvk",ios::out);
   
-  int kmax=(int) hypot(mx-1,my-1);
-  double Z[kmax+1];
-  for(int k=0; k <= kmax; ++k) Z[k]=0.0;
+  unsigned n=nshells(mx,my);
+  Array1<double> Z(n);
+  Z=0.0;
      
-  for(int i=-mx+1; i < mx; ++i) {
+  unsigned r=0;
+  for(int i=-mx+1; i < mx; ++i, ++r) {
     vector wi=w[i];
-    int i2=i*i;
-    for(int j=(i <= 0 ? 1 : 0); j < my; ++j) {
-      int k=sqrt(i2+j*j);
-      Z[(int) (k+0.5)] += abs2(wi[j]);
+    for(const ShellRun *R=shells.begin(r); R < shells.end(r); ++R) {
+      double sum=0.0;
+      for(unsigned j=R->start; j < R->stop; ++j)
+        sum += abs2(wi[j]);
+      Z[R->K] += sum;
     }
   }
   zkvk << "# k\tZ(k)" << endl;
   
-  for(int k=1; k <= kmax; ++k) {
-    zkvk << k << "\t" << Z[k] << endl;
+  for(unsigned K=0; K < n; ++K) {
+    zkvk << kc(K) << "\t" << Z[K] << endl;
   }
 }
 
-void Output(int step, bool verbose=false)
+void Invariants(const vector2& w, double& E, double& Z, double& P,
+                Workspace& W=work)
 {
-  double E=0.0, Z=0.0, P=0.0;
+  Array2<double>& invariants=W.invariants;
+#pragma omp parallel for num_threads(W.threads)
   for(int i=-mx+1; i < mx; ++i) {
     vector wi=w[i];
+    Array1<double>::opt k2invi=k2inv[i];
     double i2=i*i;
+    double e=0.0, z=0.0, p=0.0;
     for(int j=(i <= 0 ? 1 : 0); j < my; ++j) {
       double w2=abs2(wi[j]);
-      double k2=i2+j*j;
-      P += k2*w2;
-      Z += w2;
-      E += w2/k2;
+      p += (i2+j*j)*w2;
+      z += w2;
+      e += w2*k2invi[j];
     }
+    Array1<double>::opt s=invariants[i];
+    s[0]=e;
+    s[1]=z;
+    s[2]=p;
   }
+  
+  unsigned n=2*mx-1;
+  E=sum(invariants(),n,3);
+  Z=sum(invariants()+1,n,3);
+  P=sum(invariants()+2,n,3);
+}
+
+void Output(int step, bool verbose=false)
+{
+  double E,Z,P;
+  Invariants(w,E,Z,P);
   if(verbose) {
     cout << "t=" << step*dt << endl;
     cout << "Energy=" << E << endl;
@@ -124,6 +201,145 @@ void Output(int step, bool verbose=false)
   ezvt << E << "\t" << Z << "\t" << P << endl;
 }
 
+// Copy the stored modes of a to b.
+void Copy(const vector2& a, vector2& b)
+{
+  for(int i=-mx+1; i < mx; ++i) {
+    vector ai=a[i];
+    vector bi=b[i];
+    for(int j=(i <= 0 ? 1 : 0); j < my; ++j)
+      bi[j]=ai[j];
+  }
+}
+
+vector2 *Allocate(int n)
+{
+  vector2 *U=new vector2[n];
+  for(int p=0; p < n; ++p) {
+    U[p].Allocate(Nx,my,-mx+1,0,sizeof(Complex));
+    U[p][0][0]=0.0;
+  }
+  return U;
+}
+
+// Advance w by n steps with Parareal, writing the invariants of steps
+// 1,...,n-1 to ezvt and the convergence history to the file parareal.
+void Parareal(int n)
+{
+  if(n % slices != 0) {
+    cerr << "The number of steps must be a multiple of slices" << endl;
+    exit(1);
+  }
+  int nfine=n/slices;
+  double H=nfine*dt;
+  double h=H/coarse;
+
+  unsigned threads=1;
+#ifdef _OPENMP
+  threads=min(omp_get_max_threads(),slices);
+#endif
+  Workspace *fine=new Workspace[threads];
+  for(unsigned t=0; t < threads; ++t)
+    fine[t].Allocate(1);
+
+  vector2 *U=Allocate(slices+1); // State at the start of each slice
+  vector2 *Fine=Allocate(slices+1); // Fine propagation of U[p-1]
+  vector2 *G=Allocate(slices+1); // Coarse propagation of U[p-1]
+  vector2 g;
+  g.Allocate(Nx,my,-mx+1,0,sizeof(Complex));
+  g[0][0]=0.0;
+  double *E=new double[slices+1];
+  double *Z=new double[slices+1];
+  double *P=new double[slices+1];
+  // Invariants of each step, from the latest fine sweep of its slice
+  double *history=new double[3*n];
+
+  // Initial guess from the coarse propagator alone.
+  Copy(w,U[0]);
+  Invariants(U[0],E[0],Z[0],P[0]);
+  for(int p=0; p < slices; ++p) {
+    Copy(U[p],G[p+1]);
+    Advance(G[p+1],coarse,h,work);
+    Copy(G[p+1],U[p+1]);
+    Invariants(U[p+1],E[p+1],Z[p+1],P[p+1]);
+  }
+
+  ofstream fparareal("parareal",ios::out);
+  fparareal << "# k\tdE\tdZ" << endl;
+
+  // After iteration k, the slices up to k+1 agree with the serial fine
+  // solution, so at most slices iterations are needed.
+  for(int k=0; k < slices; ++k) {
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for(int p=k; p < slices; ++p) {
+      unsigned t=0;
+#ifdef _OPENMP
+      t=omp_get_thread_num();
+#endif
+      Copy(U[p],Fine[p+1]);
+      for(int s=1; s <= nfine; ++s) {
+        Advance(Fine[p+1],1,dt,fine[t]);
+        if(s < nfine) {
+          double *r=history+3*(p*nfine+s);
+          Invariants(Fine[p+1],r[0],r[1],r[2],fine[t]);
+        }
+      }
+    }
+
+    double dE=0.0, dZ=0.0;
+    Copy(Fine[k+1],U[k+1]);
+    for(int p=k+1; p <= slices; ++p) {
+      if(p > k+1) {
+        // U[p]=G(U[p-1])+F(U_old[p-1])-G(U_old[p-1])
+        Copy(U[p-1],g);
+        Advance(g,coarse,h,work);
+        for(int i=-mx+1; i < mx; ++i) {
+          vector Ui=U[p][i];
+          vector gi=g[i];
+          vector Gi=G[p][i];
+          vector Fi=Fine[p][i];
+          for(int j=(i <= 0 ? 1 : 0); j < my; ++j) {
+            Ui[j]=gi[j]+Fi[j]-Gi[j];
+            Gi[j]=gi[j];
+          }
+        }
+      }
+      double Ep=E[p], Zp=Z[p];
+      Invariants(U[p],E[p],Z[p],P[p]);
+      dE=max(dE,fabs(E[p]-Ep)/fabs(E[p]));
+      dZ=max(dZ,fabs(Z[p]-Zp)/fabs(Z[p]));
+    }
+
+    cout << "Parareal iteration " << k << ": dE=" << dE << " dZ=" << dZ
+         << endl;
+    fparareal << k << "\t" << dE << "\t" << dZ << endl;
+    if(dE < tolerance && dZ < tolerance) break;
+  }
+
+  for(int p=1; p < slices; ++p) {
+    double *r=history+3*p*nfine;
+    r[0]=E[p];
+    r[1]=Z[p];
+    r[2]=P[p];
+  }
+  for(int step=1; step < n; ++step) {
+    double *r=history+3*step;
+    ezvt << r[0] << "\t" << r[1] << "\t" << r[2] << endl;
+  }
+  Copy(U[slices],w);
+
+  for(unsigned t=0; t < threads; ++t)
+    fine[t].Deallocate();
+  delete [] fine;
+  delete [] U;
+  delete [] Fine;
+  delete [] G;
+  delete [] E;
+  delete [] Z;
+  delete [] P;
+  delete [] history;
+}
+
 int main(int argc, char* argv[])
 {
   int n;
@@ -132,12 +348,21 @@ int main(int argc, char* argv[])
   
   mx=(Nx+1)/2;
   my=(Ny+1)/2;
+
+  // Plan once per size, thread count, and CPU; later launches reuse it.
+  ostringstream size;
+  size << Nx << "x" << Ny;
+  SetWisdom("protodns",size.str(),fftw::maxthreads);
+  shells.Allocate(mx,my);
+  k2inv.Allocate(Nx,my,-mx+1,0);
+  for(int i=-mx+1; i < mx; ++i) {
+    int i2=i*i;
+    for(int j=(i <= 0 ? 1 : 0); j < my; ++j)
+      k2inv[i][j]=1.0/(i2+j*j);
+  }
   size_t align=sizeof(Complex);
   
-  f0.Allocate(Nx,my,-mx+1,0,align);
-  f1.Allocate(Nx,my,-mx+1,0,align);
-
-  Convolution=new ImplicitHConvolution2(mx,my,true,true,2,2);
+  work.Allocate();
   
   w.Allocate(Nx,my,-mx+1,0,align);
   
@@ -146,18 +371,17 @@ int main(int argc, char* argv[])
 
   cout.precision(15);
   
-  for(int step=0; step < n; ++step) {
-    Output(step,step == 0);
-     Source(w,f0);
-     for(int i=-mx+1; i < mx; ++i) {
-       vector wi=w[i];
-       vector f0i=f0[i];
-       for(int j=(i <= 0 ? 1 : 0); j < my; ++j)
-	 wi[j] += f0i[j]*dt;
-     }
-     cout << "[" << step << "] " << flush;
-  }
-  cout << endl;
+  if(slices > 0) {
+    Output(0,true);
+    Parareal(n);
+  } else {
+    for(int step=0; step < n; ++step) {
+      Output(step,step == 0);
+      Advance(w,1,dt,work);
+      cout << "[" << step << "] " << flush;
+    }
+    cout << endl;
+  }
   Output(n,true);
   Spectrum();
      
@@ -1,9 +1,16 @@
 #include <cmath>
 #include <iomanip>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <sys/stat.h>
 #include "Complex.h"
 #include "convolution.h"
 #include "Array.h"
+#include "shells.h"
+#include "sum.h"
+#include "wisdom.h"
+#include "probe.h"
 
 using namespace std;
 using namespace Array;
@@ -26,12 +33,79 @@ typedef Array3<Complex> vector3;
 typedef Array4<Complex> vector4;
 
 vector4 u;
+vector4 un,acc; // Initial value and accumulated increment of a step
 vector3 f0,f1,f2,f3,f4,f5;
+Array3<double> invariants; // Row partial sums of E and Z
 
 ofstream ezvt("ezvt",ios::out);
 
+// Binary output stream in xdr (big-endian) byte order.
+class bofstream : public ofstream {
+public:
+  bofstream(const char *name) : ofstream(name,ios::out | ios::binary) {}
+
+  template<class T>
+  bofstream& operator << (const T& x) {
+    char b[sizeof(T)];
+    memcpy(b,&x,sizeof(T));
+    const unsigned one=1;
+    if(*(const char *) &one) reverse(b,b+sizeof(T));
+    write(b,sizeof(T));
+    return *this;
+  }
+};
+
+// Modes (kx,ky,kz) whose velocity is recorded every step, and the number
+// of steps buffered between writes.
+int probes[][3]={{1,0,0},{0,1,1},{1,1,1}};
+const unsigned nprobes=sizeof(probes)/sizeof(probes[0]);
+unsigned probebuffer=1024;
+
+ProbeBuffer probe;
+bofstream fprobe("probe");
+
+// Constant-power forcing: the modes of the shells with |kc-kforce| <=
+// deltaf/2 are amplified in proportion to their amplitude so as to inject
+// energy at the rate eta.
+double eta=0.0;
+double kforce=2.0;
+double deltaf=1.0;
+
+int noutput=10; // Steps between outputs of the shell diagnostics
+
 ImplicitHConvolution3 *Convolution;
 
+inline double hypot(double x, double y, double z)
+{
+  return sqrt(x*x+y*y+z*z);
+}
+
+inline double abs2(Complex x, Complex y, Complex z)
+{
+  return abs2(x)+abs2(y)+abs2(z);
+}
+
+ShellIndex shells;
+unsigned nshell;
+
+inline bool forced(unsigned K)
+{
+  return fabs(kc(K)-kforce) <= 0.5*deltaf;
+}
+
+// Shell diagnostics: energy, enstrophy, and the rates of energy transfer,
+// dissipation, and injection. Each x slab i accumulates its own partial
+// sums, which are combined in slab order, so that the results do not
+// depend on the number of threads.
+enum Diagnostic {EK,ZK,TK,DK,EPSK,NDIAG};
+Array2<double> slabs; // (i,NDIAG*nshell)
+Array2<double> diagnostics; // (NDIAG,nshell)
+Array1<double> bandenergy; // Forcing-band energy of each slab
+unsigned shellcount=0;
+
+// Integrating factors exp(-nu*k2*dt/2) and exp(-nu*k2*dt), indexed by k2.
+Array1<double> halffactor,factor;
+
 void init(vector4& u)
 {
   for(int i=-mx+1; i < mx; ++i) {
@@ -80,21 +154,45 @@ void multadvection3(double **F, unsigned int m,
   }
 }
 
+// Accumulate the shell diagnostics of the current step?
+bool diagnose;
+
+// Scale of the forcing of each mode in the band, eta/(2*E_band).
+double alpha;
+
+// The projected nonlinear term plus the forcing. The viscous term is
+// integrated exactly by Step, so Source only reports the dissipation.
 void Source(const vector4& u, vector4 &S)
 {
   f0[0][0][0]=0.0;
   f1[0][0][0]=0.0;
   f2[0][0][0]=0.0;
   
+#pragma omp parallel for
   for(int i=-mx+1; i < mx; ++i) {
-    for(int j=-my+1; j < my; ++j) {
-      for(int k=(j < 0 || (j == 0 && i <= 0)) ? 1 : 0; k < mz; ++k) {
-        f0[i][j][k]=u[0][i][j][k];
-        f1[i][j][k]=u[1][i][j][k];
-        f2[i][j][k]=u[2][i][j][k];
+    double Eband=0.0;
+    unsigned r=(i+mx-1)*(2*my-1);
+    for(int j=-my+1; j < my; ++j, ++r) {
+      vector u0=u[0][i][j];
+      vector u1=u[1][i][j];
+      vector u2=u[2][i][j];
+      vector f0ij=f0[i][j];
+      vector f1ij=f1[i][j];
+      vector f2ij=f2[i][j];
+      for(const ShellRun *R=shells.begin(r); R < shells.end(r); ++R) {
+        bool band=eta && forced(R->K);
+        for(int k=R->start; k < (int) R->stop; ++k) {
+          f0ij[k]=u0[k];
+          f1ij[k]=u1[k];
+          f2ij[k]=u2[k];
+          if(band) Eband += abs2(u0[k],u1[k],u2[k]);
+        }
       }
-    } 
+    }
+    bandenergy[i+mx-1]=Eband;
   }
+  double Eband=sum(bandenergy(),Nx);
+  alpha=Eband > 0.0 ? 0.5*eta/Eband : 0.0;
 
   Complex *F[]={f0,f1,f2,f3,f4,f5};
   Convolution->convolve(F,multadvection3);
@@ -108,33 +206,68 @@ void Source(const vector4& u, vector4 &S)
   S2(0,0,0)=0.0;
   
   // The purpose of pressure is to enforce incompressibility!
-  // Apply projection operator.
+  // Apply projection operator, then add the forcing.
+  // Each x slab i bins its own contribution to the shell diagnostics.
+#pragma omp parallel for
   for(int i=-mx+1; i < mx; ++i) {
-    for(int j=-my+1; j < my; ++j) {
-      for(int k=(j < 0 || (j == 0 && i <= 0)) ? 1 : 0; k < mz; ++k) {
-        Complex S00=f0[i][j][k];
-        Complex S01=f1[i][j][k];
-        Complex S02=f2[i][j][k];
-        Complex S11=f3[i][j][k];
-        Complex S12=f4[i][j][k];
-        Complex S22=f5[i][j][k];
+    Array1<double>::opt d=slabs[i];
+    if(diagnose)
+      for(unsigned n=0; n < NDIAG*nshell; ++n)
+        d[n]=0.0;
+    unsigned r=(i+mx-1)*(2*my-1);
+    for(int j=-my+1; j < my; ++j, ++r) {
+      int ij2=i*i+j*j;
+      for(const ShellRun *R=shells.begin(r); R < shells.end(r); ++R) {
+        double a=eta && forced(R->K) ? alpha : 0.0;
+        double E=0.0, Z=0.0, T=0.0, D=0.0;
+        for(int k=R->start; k < (int) R->stop; ++k) {
+          Complex S00=f0[i][j][k];
+          Complex S01=f1[i][j][k];
+          Complex S02=f2[i][j][k];
+          Complex S11=f3[i][j][k];
+          Complex S12=f4[i][j][k];
+          Complex S22=f5[i][j][k];
         
-        Complex s0=Complex(0.0,i*S00+j*S01+k*S02);
-        Complex s1=Complex(0.0,i*S01+j*S11+k*S12);
-        Complex s2=Complex(0.0,i*S02+j*S12+k*S22);
+          Complex s0=Complex(0.0,1.0)*(i*S00+j*S01+k*S02);
+          Complex s1=Complex(0.0,1.0)*(i*S01+j*S11+k*S12);
+          Complex s2=Complex(0.0,1.0)*(i*S02+j*S12+k*S22);
         
-        // Calculate -i*P
-        Complex miP=(i*s0+j*s1+k*s2)/(i*i+j*j+k*k);
-        S0[i][j][k]=i*miP-s0;
-        S1[i][j][k]=j*miP-s1;
-        S2[i][j][k]=k*miP-s2;
+          // Calculate -i*P
+          int k2=ij2+k*k;
+          Complex miP=(i*s0+j*s1+k*s2)/k2;
+          Complex N0=i*miP-s0;
+          Complex N1=j*miP-s1;
+          Complex N2=k*miP-s2;
+
+          Complex U=u[0][i][j][k];
+          Complex V=u[1][i][j][k];
+          Complex W=u[2][i][j][k];
+          S0[i][j][k]=N0+a*U;
+          S1[i][j][k]=N1+a*V;
+          S2[i][j][k]=N2+a*W;
+
+          if(diagnose) {
+            double e=abs2(U,V,W);
+            E += e;
+            Z += k2*e;
+            T += (N0*conj(U)).re+(N1*conj(V)).re+(N2*conj(W)).re;
+            D += nu*k2*e;
+          }
+        }
+        if(diagnose) {
+          unsigned K=R->K;
+          d[EK*nshell+K] += E;
+          d[ZK*nshell+K] += Z;
+          d[TK*nshell+K] += 2.0*T;
+          d[DK*nshell+K] += 2.0*D;
+          d[EPSK*nshell+K] += 2.0*a*E;
+        }
       }
     }
   }
-    
-  HermitianSymmetrizeXY(mx,my,mz,mx-1,my-1,S0);
-  HermitianSymmetrizeXY(mx,my,mz,mx-1,my-1,S1);
-  HermitianSymmetrizeXY(mx,my,mz,mx-1,my-1,S2);
+
+  // Only the stored half space is advanced and read; the convolution
+  // symmetrizes the k=0 plane of its inputs itself.
   
 #if 0
   Complex sum=0.0;
@@ -152,73 +285,134 @@ void Source(const vector4& u, vector4 &S)
   cout << "sum=" << sum << endl;
   cout << endl;
 #endif  
-  
-  for(int i=-mx+1; i < mx; ++i) {
-    for(int j=-my+1; j < my; ++j) {
-      for(int k=(j < 0 || (j == 0 && i <= 0)) ? 1 : 0; k < mz; ++k) {
-        double nuk2=nu*(i*i+j*j+k*k);
-        S0[i][j][k] -= nuk2*S0;
-        S1[i][j][k] -= nuk2*S1;
-        S2[i][j][k] -= nuk2*S2;
+}
+
+// Advance u by one step of the classical fourth-order Runge-Kutta scheme
+// applied to exp(nu*k^2*t)*u, which removes the viscous stability limit on
+// dt. Only the first stage accumulates the shell diagnostics.
+void Step(vector4& S)
+{
+  double h=dt;
+  for(int stage=0; stage < 4; ++stage) {
+    Source(u,S);
+    diagnose=false;
+#pragma omp parallel for
+    for(int i=-mx+1; i < mx; ++i) {
+      for(int j=-my+1; j < my; ++j) {
+        int ij2=i*i+j*j;
+        int start=(j < 0 || (j == 0 && i <= 0)) ? 1 : 0;
+        for(int c=0; c < 3; ++c) {
+          vector uc=u[c][i][j];
+          vector unc=un[c][i][j];
+          vector accc=acc[c][i][j];
+          vector Sc=S[c][i][j];
+          for(int k=start; k < mz; ++k) {
+            int k2=ij2+k*k;
+            double E=factor[k2];
+            double Eh=halffactor[k2];
+            Complex s=Sc[k];
+            switch(stage) {
+              case 0:
+                unc[k]=uc[k];
+                accc[k]=E*(uc[k]+(h/6.0)*s);
+                uc[k]=Eh*(uc[k]+(0.5*h)*s);
+                break;
+              case 1:
+                accc[k] += (h/3.0)*Eh*s;
+                uc[k]=Eh*unc[k]+(0.5*h)*s;
+                break;
+              case 2:
+                accc[k] += (h/3.0)*Eh*s;
+                uc[k]=E*unc[k]+h*Eh*s;
+                break;
+              case 3:
+                uc[k]=accc[k]+(h/6.0)*s;
+                break;
+            }
+          }
+        }
       }
     }
   }
 }
 
-inline double hypot(double x, double y, double z)
+// Combine the slabs into the shell diagnostics and write them, with the
+// time t, to shells/t<n> in the xdr curve format of the 2D code:
+// t, then E(k), Z(k), T(k), D(k), and eps(k).
+void OutShells(double t)
 {
-  return sqrt(x*x+y*y+z*z);
+#pragma omp parallel for
+  for(int n=0; n < (int) (NDIAG*nshell); ++n)
+    diagnostics()[n]=sum(&slabs(-mx+1,n),Nx,NDIAG*nshell);
+
+  ostringstream buf;
+  buf << "shells/t" << shellcount++;
+  bofstream fout(buf.str().c_str());
+  fout << 1 << t;
+  for(unsigned f=0; f < NDIAG; ++f) {
+    fout << nshell;
+    for(unsigned K=0; K < nshell; ++K)
+      fout << diagnostics(f,K);
+  }
+  fout.close();
+  if(!fout) {
+    cerr << "Cannot write to file " << buf.str() << endl;
+    exit(1);
+  }
 }
 
-inline double abs2(Complex x, Complex y, Complex z)
+// Append the velocity of the probed modes to the buffer, writing it out
+// when full.
+void Probe(double t)
 {
-  return abs2(x)+abs2(y)+abs2(z);
+  Complex *z=probe.Record(t);
+  for(unsigned p=0; p < nprobes; ++p) {
+    int i=probes[p][0];
+    int j=probes[p][1];
+    int k=probes[p][2];
+    // Modes outside the stored half space are conjugates of stored modes.
+    bool c=k < 0 || (k == 0 && (j < 0 || (j == 0 && i < 0)));
+    for(int n=0; n < 3; ++n)
+      *(z++)=c ? conj(u[n][-i][-j][-k]) : u[n][i][j][k];
+  }
+  if(probe.Full()) probe.Flush(fprobe);
 }
 
+// Write the final energy and enstrophy spectra as text.
 void Spectrum()
 {
   ofstream ekvk("ekvk",ios::out);
   
-  int kmax=(int) hypot(mx-1,my-1,mz-1);
-  double E[kmax+1];
-  double Z[kmax+1];
-  for(int K=0; K <= kmax; ++K) {
-    E[K]=0.0;
-    Z[K]=0.0;
-  }
-     
-  for(int i=-mx+1; i < mx; ++i) {
-    for(int j=-my+1; j < my; ++j) {
-      for(int k=(j < 0 || (j == 0 && i <= 0)) ? 1 : 0; k < mz; ++k) {
-	int k2=i*i+j*j+k*k;
-        int K=sqrt(k2);	
-        int index=(int) (K+0.5);
-        double e=abs2(u[0][i][j][k],u[1][i][j][k],u[2][i][j][k]);
-        E[index] += e;
-        Z[index] += k2*e;
-      }
-    }
-  }
-    
   ekvk << "# k\tE(k)" << endl;
   
-  for(int k=1; k <= kmax; ++k)
-    ekvk << k << "\t" << E[k] << "\t" << Z[k] << endl;
+  for(unsigned K=0; K < nshell; ++K)
+    ekvk << kc(K) << "\t" << diagnostics(EK,K) << "\t" << diagnostics(ZK,K)
+         << endl;
 }
 
 void Output(int step, bool verbose=false)
 {
-  double E=0.0, Z=0.0;
+#pragma omp parallel for
   for(int i=-mx+1; i < mx; ++i) {
     for(int j=-my+1; j < my; ++j) {
+      vector u0=u[0][i][j];
+      vector u1=u[1][i][j];
+      vector u2=u[2][i][j];
+      double ij2=i*i+j*j;
+      double E=0.0, Z=0.0;
       for(int k=(j < 0 || (j == 0 && i <= 0)) ? 1 : 0; k < mz; ++k) {
-	double k2=i*i+j*j+k*k;
-        double e=abs2(u[0][i][j][k],u[1][i][j][k],u[2][i][j][k]);
+        double e=abs2(u0[k],u1[k],u2[k]);
 	E += e;
-	Z += k2*e;
+	Z += (ij2+k*k)*e;
       }
+      invariants(i,j,0)=E;
+      invariants(i,j,1)=Z;
     }
   }
+  
+  unsigned n=(2*mx-1)*(2*my-1);
+  double E=sum(invariants(),n,2);
+  double Z=sum(invariants()+1,n,2);
   if(verbose) {
     cout << "t=" << step*dt << endl;
     cout << "Energy=" << E << endl;
@@ -239,6 +433,18 @@ int main(int argc, char* argv[])
   mx=(Nx+1)/2;
   my=(Ny+1)/2;
   mz=(Nz+1)/2;
+
+  // Plan once per size, thread count, and CPU; later launches reuse it.
+  ostringstream size;
+  size << Nx << "x" << Ny << "x" << Nz;
+  SetWisdom("protodns3",size.str(),fftw::maxthreads);
+  shells.Allocate(mx,my,mz);
+  nshell=nshells(mx,my,mz);
+  slabs.Allocate(Nx,NDIAG*nshell,-mx+1,0);
+  diagnostics.Allocate(NDIAG,nshell);
+  bandenergy.Allocate(Nx);
+  invariants.Allocate(Nx,Ny,2,-mx+1,-my+1,0);
+  mkdir("shells",0xFFFF);
   size_t align=sizeof(Complex);
 
   f0.Allocate(Nx,Ny,mz,-mx+1,-my+1,0,align);
@@ -252,6 +458,16 @@ int main(int argc, char* argv[])
   
   u.Allocate(3,Nx,Ny,mz,0,-mx+1,-my+1,0,align);
   S.Allocate(3,Nx,Ny,mz,0,-mx+1,-my+1,0,align);
+  un.Allocate(3,Nx,Ny,mz,0,-mx+1,-my+1,0,align);
+  acc.Allocate(3,Nx,Ny,mz,0,-mx+1,-my+1,0,align);
+
+  unsigned kmax2=(mx-1)*(mx-1)+(my-1)*(my-1)+(mz-1)*(mz-1);
+  halffactor.Allocate(kmax2+1);
+  factor.Allocate(kmax2+1);
+  for(unsigned k2=0; k2 <= kmax2; ++k2) {
+    halffactor[k2]=exp(-0.5*nu*k2*dt);
+    factor[k2]=exp(-nu*k2*dt);
+  }
   
   init(u);
   u(0,0,0,0)=0.0; // Enforce no mean flow.
@@ -262,25 +478,34 @@ int main(int argc, char* argv[])
   HermitianSymmetrizeXY(mx,my,mz,mx-1,my-1,u[1]);
   HermitianSymmetrizeXY(mx,my,mz,mx-1,my-1,u[2]);
   
+  for(unsigned p=0; p < nprobes; ++p) {
+    int *k=probes[p];
+    if(abs(k[0]) >= mx || abs(k[1]) >= my || abs(k[2]) >= mz ||
+       (k[0] == 0 && k[1] == 0 && k[2] == 0)) {
+      cerr << "Probed modes must be nonzero and lie within the grid" << endl;
+      exit(1);
+    }
+  }
+  probe.Allocate(nprobes,3,3,probes[0],probebuffer);
+
   cout.precision(15);
   
   for(int step=0; step < n; ++step) {
 //    Output(step,step == 0);
     Output(step,true);
-    Source(u,S);
-    for(int i=-mx+1; i < mx; ++i) {
-      for(int j=-my+1; j < my; ++j) {
-	for(int k=(j < 0 || (j == 0 && i <= 0)) ? 1 : 0; k < mz; ++k) {
-          for(int c=0; c < 3; ++c) {
-            u[c][i][j][k] += S[c][i][j][k]*dt;
-          }
-        }
-      }
-    }
+    bool out=step % noutput == 0;
+    diagnose=out;
+    Step(S);
+    if(out) OutShells(step*dt);
+    Probe((step+1)*dt);
     cout << "[" << step << "] ";
   }
   cout << endl;
+  probe.Flush(fprobe);
   Output(n,true);
+  diagnose=true;
+  Source(u,S);
+  OutShells(n*dt);
   Spectrum();
      
   return 0;
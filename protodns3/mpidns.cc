@@ -0,0 +1,574 @@
+#include <mpi.h>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <fftw3.h>
+#include <omp.h>
+#include "Complex.h"
+#include "shells.h"
+#include "sum.h"
+
+// Distributed version of protodns3. The modes are split over a Py x Pz
+// process grid in pencils:
+//
+//   A (spectral, x-pencils): all kx; ky block p; kz block q
+//   B (y-pencils):           x block p; all y; kz block q
+//   C (z-pencils):           x block p; y block q; all z
+//
+// u and S are stored in layout A. The convolution pads each direction by
+// the 3/2 rule on the way to physical space and truncates on the way back;
+// the transposes A<->B run over the ranks of a row (fixed q) and B<->C over
+// the ranks of a column (fixed p), with all components in one MPI_Alltoallv.
+//
+// The whole kz=0 plane is stored and advanced; the c2r transforms in z
+// discard its anti-Hermitian part, so it is symmetrized implicitly.
+
+using namespace std;
+
+int Nx=15; // Number of modes in x direction
+int Ny=15; // Number of modes in y direction
+int Nz=15; // Number of modes in z direction
+
+double dt=1.0e-8;
+double nu=0.0; // kinematic viscosity
+
+int mx,my,mz;
+int nx,ny,nz,nzp; // Dealiased physical grid; nzp=nz/2+1
+
+// Block decomposition of n items over P ranks
+struct Block {
+  int n,P;
+  Block() {}
+  Block(int n, int P) : n(n), P(P) {}
+  int size(int p) const {return n/P+(p < n%P);}
+  int start(int p) const {return p*(n/P)+min(p,n%P);}
+};
+
+int procrank,p,q; // Rank and coordinates in the process grid
+int Py,Pz;
+MPI_Comm rowcomm,colcomm; // Ranks with the same q, and with the same p
+MPI_Datatype MPIComplex;
+
+Block Jy,Kz,Xb,Yc;
+int nyA,nzA,nxB,nyC; // Local sizes
+size_t nA,nB,nC,nR; // Local elements per field of each layout
+
+Complex *u,*S; // [c][jl][kl][i]
+Complex *bufA,*bufB,*bufC;
+double *phys;
+Complex *sendbuf,*recvbuf;
+int *sendcounts,*senddispls,*recvcounts,*recvdispls;
+
+fftw_plan xb,xf,yb,yf,zb,zf;
+
+ofstream ezvt;
+
+inline int xpos(int kx) {return kx >= 0 ? kx : nx+kx;}
+inline int ypos(int ky) {return ky >= 0 ? ky : ny+ky;}
+
+inline size_t indexA(int c, int jl, int kl, int i)
+{
+  return ((size_t) (c*nyA+jl)*nzA+kl)*Nx+i;
+}
+
+void Alltoall(MPI_Comm comm, int P)
+{
+  senddispls[0]=recvdispls[0]=0;
+  for(int r=1; r < P; ++r) {
+    senddispls[r]=senddispls[r-1]+sendcounts[r-1];
+    recvdispls[r]=recvdispls[r-1]+recvcounts[r-1];
+  }
+  MPI_Alltoallv(sendbuf,sendcounts,senddispls,MPIComplex,
+                recvbuf,recvcounts,recvdispls,MPIComplex,comm);
+}
+
+// x-pencils of bufA to y-pencils of bufB (padded in y).
+void TransposeAB(int F)
+{
+  Complex *s=sendbuf;
+  for(int r=0; r < Py; ++r) {
+    int x0=Xb.start(r), nxr=Xb.size(r);
+    for(int f=0; f < F; ++f)
+      for(int jl=0; jl < nyA; ++jl)
+        for(int kl=0; kl < nzA; ++kl) {
+          Complex *a=bufA+((size_t) (f*nyA+jl)*nzA+kl)*nx+x0;
+          for(int x=0; x < nxr; ++x)
+            *(s++)=a[x];
+        }
+    sendcounts[r]=F*nyA*nzA*nxr;
+    recvcounts[r]=F*Jy.size(r)*nzA*nxB;
+  }
+  Alltoall(rowcomm,Py);
+
+  for(size_t n=0; n < F*nB; ++n)
+    bufB[n]=0.0;
+  Complex *t=recvbuf;
+  for(int r=0; r < Py; ++r) {
+    int j0=Jy.start(r), nyr=Jy.size(r);
+    for(int f=0; f < F; ++f)
+      for(int jl=0; jl < nyr; ++jl) {
+        int y=ypos(j0+jl-(my-1));
+        for(int kl=0; kl < nzA; ++kl)
+          for(int x=0; x < nxB; ++x)
+            bufB[((size_t) (f*nxB+x)*nzA+kl)*ny+y]=*(t++);
+      }
+  }
+}
+
+// y-pencils of bufB to z-pencils of bufC (padded in z).
+void TransposeBC(int F)
+{
+  Complex *s=sendbuf;
+  for(int r=0; r < Pz; ++r) {
+    int y0=Yc.start(r), nyr=Yc.size(r);
+    for(int f=0; f < F; ++f)
+      for(int x=0; x < nxB; ++x)
+        for(int kl=0; kl < nzA; ++kl) {
+          Complex *b=bufB+((size_t) (f*nxB+x)*nzA+kl)*ny+y0;
+          for(int y=0; y < nyr; ++y)
+            *(s++)=b[y];
+        }
+    sendcounts[r]=F*nxB*nzA*nyr;
+    recvcounts[r]=F*nxB*Kz.size(r)*nyC;
+  }
+  Alltoall(colcomm,Pz);
+
+  for(size_t n=0; n < F*nC; ++n)
+    bufC[n]=0.0;
+  Complex *t=recvbuf;
+  for(int r=0; r < Pz; ++r) {
+    int k0=Kz.start(r), nzr=Kz.size(r);
+    for(int f=0; f < F; ++f)
+      for(int x=0; x < nxB; ++x)
+        for(int kl=0; kl < nzr; ++kl)
+          for(int y=0; y < nyC; ++y)
+            bufC[((size_t) (f*nxB+x)*nyC+y)*nzp+k0+kl]=*(t++);
+  }
+}
+
+// z-pencils of bufC (truncated to mz) to y-pencils of bufB.
+void TransposeCB(int F)
+{
+  Complex *s=sendbuf;
+  for(int r=0; r < Pz; ++r) {
+    int k0=Kz.start(r), nzr=Kz.size(r);
+    for(int f=0; f < F; ++f)
+      for(int x=0; x < nxB; ++x)
+        for(int y=0; y < nyC; ++y) {
+          Complex *c=bufC+((size_t) (f*nxB+x)*nyC+y)*nzp+k0;
+          for(int kl=0; kl < nzr; ++kl)
+            *(s++)=c[kl];
+        }
+    sendcounts[r]=F*nxB*nyC*nzr;
+    recvcounts[r]=F*nxB*Yc.size(r)*nzA;
+  }
+  Alltoall(colcomm,Pz);
+
+  Complex *t=recvbuf;
+  for(int r=0; r < Pz; ++r) {
+    int y0=Yc.start(r), nyr=Yc.size(r);
+    for(int f=0; f < F; ++f)
+      for(int x=0; x < nxB; ++x)
+        for(int y=0; y < nyr; ++y)
+          for(int kl=0; kl < nzA; ++kl)
+            bufB[((size_t) (f*nxB+x)*nzA+kl)*ny+y0+y]=*(t++);
+  }
+}
+
+// y-pencils of bufB (truncated to Ny) to x-pencils of bufA.
+void TransposeBA(int F)
+{
+  Complex *s=sendbuf;
+  for(int r=0; r < Py; ++r) {
+    int j0=Jy.start(r), nyr=Jy.size(r);
+    for(int f=0; f < F; ++f)
+      for(int x=0; x < nxB; ++x)
+        for(int kl=0; kl < nzA; ++kl) {
+          Complex *b=bufB+((size_t) (f*nxB+x)*nzA+kl)*ny;
+          for(int jl=0; jl < nyr; ++jl)
+            *(s++)=b[ypos(j0+jl-(my-1))];
+        }
+    sendcounts[r]=F*nxB*nzA*nyr;
+    recvcounts[r]=F*Xb.size(r)*nzA*nyA;
+  }
+  Alltoall(rowcomm,Py);
+
+  Complex *t=recvbuf;
+  for(int r=0; r < Py; ++r) {
+    int x0=Xb.start(r), nxr=Xb.size(r);
+    for(int f=0; f < F; ++f)
+      for(int x=0; x < nxr; ++x)
+        for(int kl=0; kl < nzA; ++kl)
+          for(int jl=0; jl < nyA; ++jl)
+            bufA[((size_t) (f*nyA+jl)*nzA+kl)*nx+x0+x]=*(t++);
+  }
+}
+
+void init(Complex *u)
+{
+  for(int jl=0; jl < nyA; ++jl) {
+    int j=Jy.start(p)+jl-(my-1);
+    for(int kl=0; kl < nzA; ++kl) {
+      int k=Kz.start(q)+kl;
+      for(int I=0; I < Nx; ++I) {
+        int i=I-(mx-1);
+        if(i == 0 && j == 0 && k == 0) {
+          // Enforce no mean flow.
+          for(int c=0; c < 3; ++c)
+            u[indexA(c,jl,kl,I)]=0.0;
+          continue;
+        }
+        Complex val=1.0/(i*i+j*j+k*k);
+        Complex U=val;
+        Complex V=val;
+        Complex W=val;
+        if(k != 0)
+          W=-(i*U+j*V)/k;
+        else if(j != 0)
+          V=-(i*U)/j;
+        else
+          U=0.0;
+        u[indexA(0,jl,kl,I)]=U;
+        u[indexA(1,jl,kl,I)]=V;
+        u[indexA(2,jl,kl,I)]=W;
+      }
+    }
+  }
+}
+
+void Source(const Complex *u, Complex *S)
+{
+  // Velocity to physical space
+  for(size_t n=0; n < 3*nA; ++n)
+    bufA[n]=0.0;
+#pragma omp parallel for
+  for(int c=0; c < 3; ++c)
+    for(int jl=0; jl < nyA; ++jl)
+      for(int kl=0; kl < nzA; ++kl) {
+        Complex *a=bufA+((size_t) (c*nyA+jl)*nzA+kl)*nx;
+        const Complex *uc=u+indexA(c,jl,kl,0);
+        for(int I=0; I < Nx; ++I)
+          a[xpos(I-(mx-1))]=uc[I];
+      }
+
+  fftw_execute(xb);
+  TransposeAB(3);
+  fftw_execute(yb);
+  TransposeBC(3);
+  fftw_execute(zb);
+
+  double *F0=phys;
+  double *F1=phys+nR;
+  double *F2=phys+2*nR;
+  double *F3=phys+3*nR;
+  double *F4=phys+4*nR;
+  double *F5=phys+5*nR;
+#pragma omp parallel for
+  for(size_t n=0; n < nR; ++n) {
+    double u=F0[n];
+    double v=F1[n];
+    double w=F2[n];
+    F0[n]=u*u;
+    F1[n]=u*v;
+    F2[n]=u*w;
+    F3[n]=v*v;
+    F4[n]=v*w;
+    F5[n]=w*w;
+  }
+
+  // Stress tensor back to spectral space
+  fftw_execute(zf);
+  TransposeCB(6);
+  fftw_execute(yf);
+  TransposeBA(6);
+  fftw_execute(xf);
+
+  // The purpose of pressure is to enforce incompressibility!
+  // Apply projection operator.
+  double scale=1.0/((double) nx*ny*nz);
+#pragma omp parallel for
+  for(int jl=0; jl < nyA; ++jl) {
+    int j=Jy.start(p)+jl-(my-1);
+    for(int kl=0; kl < nzA; ++kl) {
+      int k=Kz.start(q)+kl;
+      for(int I=0; I < Nx; ++I) {
+        int i=I-(mx-1);
+        size_t a0=indexA(0,jl,kl,I);
+        size_t a1=indexA(1,jl,kl,I);
+        size_t a2=indexA(2,jl,kl,I);
+        int k2=i*i+j*j+k*k;
+        if(k2 == 0) {
+          S[a0]=S[a1]=S[a2]=0.0; // Enforce no mean flow.
+          continue;
+        }
+        size_t x=((size_t) jl*nzA+kl)*nx+xpos(i);
+        size_t stride=nA;
+        Complex S00=scale*bufA[x];
+        Complex S01=scale*bufA[x+stride];
+        Complex S02=scale*bufA[x+2*stride];
+        Complex S11=scale*bufA[x+3*stride];
+        Complex S12=scale*bufA[x+4*stride];
+        Complex S22=scale*bufA[x+5*stride];
+
+        Complex s0=Complex(0.0,1.0)*(i*S00+j*S01+k*S02);
+        Complex s1=Complex(0.0,1.0)*(i*S01+j*S11+k*S12);
+        Complex s2=Complex(0.0,1.0)*(i*S02+j*S12+k*S22);
+
+        // Calculate -i*P
+        Complex miP=(i*s0+j*s1+k*s2)/k2;
+        double nuk2=nu*k2;
+        S[a0]=i*miP-s0-nuk2*u[a0];
+        S[a1]=j*miP-s1-nuk2*u[a1];
+        S[a2]=k*miP-s2-nuk2*u[a2];
+      }
+    }
+  }
+}
+
+inline double abs2(Complex x, Complex y, Complex z)
+{
+  return abs2(x)+abs2(y)+abs2(z);
+}
+
+// Half-space weight: the kz=0 plane is stored in full.
+inline double weight(int k) {return k == 0 ? 0.5 : 1.0;}
+
+// Combine the partial sums of all ranks in procrank order.
+double Allsum(double x)
+{
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD,&size);
+  double *partial=new double[size];
+  MPI_Allgather(&x,1,MPI_DOUBLE,partial,1,MPI_DOUBLE,MPI_COMM_WORLD);
+  double s=sum(partial,size);
+  delete[] partial;
+  return s;
+}
+
+void Spectrum()
+{
+  unsigned n=nshells(mx,my,mz);
+  double *E=new double[2*n];
+  double *Z=E+n;
+  for(unsigned K=0; K < 2*n; ++K)
+    E[K]=0.0;
+
+  for(int jl=0; jl < nyA; ++jl) {
+    int j=Jy.start(p)+jl-(my-1);
+    for(int kl=0; kl < nzA; ++kl) {
+      int k=Kz.start(q)+kl;
+      double wk=weight(k);
+      for(int I=0; I < Nx; ++I) {
+        int i=I-(mx-1);
+        unsigned k2=i*i+j*j+k*k;
+        if(k2 == 0) continue;
+        unsigned K=shellindex(k2);
+        if(K >= n) continue;
+        double e=wk*abs2(u[indexA(0,jl,kl,I)],u[indexA(1,jl,kl,I)],
+                         u[indexA(2,jl,kl,I)]);
+        E[K] += e;
+        Z[K] += k2*e;
+      }
+    }
+  }
+
+  double *total=new double[2*n];
+  MPI_Reduce(E,total,2*n,MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
+
+  if(procrank == 0) {
+    ofstream ekvk("ekvk",ios::out);
+    ekvk << "# k\tE(k)" << endl;
+    for(unsigned K=0; K < n; ++K)
+      ekvk << kc(K) << "\t" << total[K] << "\t" << total[n+K] << endl;
+  }
+  delete[] total;
+  delete[] E;
+}
+
+void Output(int step, bool verbose=false)
+{
+  Sum Es,Zs;
+  for(int jl=0; jl < nyA; ++jl) {
+    int j=Jy.start(p)+jl-(my-1);
+    for(int kl=0; kl < nzA; ++kl) {
+      int k=Kz.start(q)+kl;
+      double wk=weight(k);
+      double jk2=j*j+k*k;
+      const Complex *u0=u+indexA(0,jl,kl,0);
+      const Complex *u1=u+indexA(1,jl,kl,0);
+      const Complex *u2=u+indexA(2,jl,kl,0);
+      double E=0.0, Z=0.0;
+      for(int I=0; I < Nx; ++I) {
+        int i=I-(mx-1);
+        double e=abs2(u0[I],u1[I],u2[I]);
+        E += e;
+        Z += (i*i+jk2)*e;
+      }
+      Es.add(wk*E);
+      Zs.add(wk*Z);
+    }
+  }
+
+  double E=Allsum(Es.value());
+  double Z=Allsum(Zs.value());
+  if(procrank == 0) {
+    if(verbose) {
+      cout << "t=" << step*dt << endl;
+      cout << "Energy=" << E << endl;
+      cout << "Enstrophy=" << Z << endl;
+      cout << endl;
+    }
+    ezvt << E << "\t" << Z << endl;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  int provided;
+  MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&provided);
+  // Only the master thread of each rank calls MPI.
+  if(provided < MPI_THREAD_FUNNELED) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+    if(rank == 0)
+      cerr << "MPI does not support MPI_THREAD_FUNNELED" << endl;
+    MPI_Abort(MPI_COMM_WORLD,1);
+  }
+
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD,&size);
+  int dims[2]={0,0};
+  int periods[2]={0,0};
+  MPI_Dims_create(size,2,dims);
+  Py=dims[0];
+  Pz=dims[1];
+  MPI_Comm cart;
+  MPI_Cart_create(MPI_COMM_WORLD,2,dims,periods,0,&cart);
+  MPI_Comm_rank(cart,&procrank);
+  int coords[2];
+  MPI_Cart_coords(cart,procrank,2,coords);
+  p=coords[0];
+  q=coords[1];
+  int row[2]={1,0};
+  int col[2]={0,1};
+  MPI_Cart_sub(cart,row,&rowcomm);
+  MPI_Cart_sub(cart,col,&colcomm);
+  MPI_Type_contiguous(2,MPI_DOUBLE,&MPIComplex);
+  MPI_Type_commit(&MPIComplex);
+
+  int n=0;
+  if(procrank == 0) {
+    cout << "Number of time steps? " << endl;
+    cin >> n;
+    cout << endl;
+  }
+  MPI_Bcast(&n,1,MPI_INT,0,MPI_COMM_WORLD);
+
+  mx=(Nx+1)/2;
+  my=(Ny+1)/2;
+  mz=(Nz+1)/2;
+  nx=3*mx-2;
+  ny=3*my-2;
+  nz=3*mz-2;
+  nzp=nz/2+1;
+
+  Jy=Block(Ny,Py);
+  Kz=Block(mz,Pz);
+  Xb=Block(nx,Py);
+  Yc=Block(ny,Pz);
+  nyA=Jy.size(p);
+  nzA=Kz.size(q);
+  nxB=Xb.size(p);
+  nyC=Yc.size(q);
+  if(Py > Ny || Pz > mz) {
+    if(procrank == 0)
+      cerr << "Process grid " << Py << "x" << Pz << " exceeds the "
+           << Ny << "x" << mz << " modes" << endl;
+    MPI_Abort(MPI_COMM_WORLD,1);
+  }
+
+  if(procrank == 0)
+    cout << "Process grid: " << Py << "x" << Pz << endl << endl;
+
+  nA=(size_t) nyA*nzA*nx;
+  nB=(size_t) nxB*nzA*ny;
+  nC=(size_t) nxB*nyC*nzp;
+  nR=(size_t) nxB*nyC*nz;
+  size_t nu3=(size_t) 3*nyA*nzA*Nx;
+
+  u=(Complex *) fftw_malloc(nu3*sizeof(Complex));
+  S=(Complex *) fftw_malloc(nu3*sizeof(Complex));
+  bufA=(Complex *) fftw_malloc(6*nA*sizeof(Complex));
+  bufB=(Complex *) fftw_malloc(6*nB*sizeof(Complex));
+  bufC=(Complex *) fftw_malloc(6*nC*sizeof(Complex));
+  phys=(double *) fftw_malloc(6*nR*sizeof(double));
+  size_t nbuf=6*max(max(nA,nB),nC);
+  sendbuf=(Complex *) fftw_malloc(nbuf*sizeof(Complex));
+  recvbuf=(Complex *) fftw_malloc(nbuf*sizeof(Complex));
+  int P=max(Py,Pz);
+  sendcounts=new int[4*P];
+  senddispls=sendcounts+P;
+  recvcounts=sendcounts+2*P;
+  recvdispls=sendcounts+3*P;
+
+  fftw_init_threads();
+  fftw_plan_with_nthreads(omp_get_max_threads());
+
+  // Plans for the 3 velocity components in and the 6 stresses out
+  fftw_complex *A=(fftw_complex *) bufA;
+  fftw_complex *B=(fftw_complex *) bufB;
+  fftw_complex *C=(fftw_complex *) bufC;
+  unsigned flags=FFTW_MEASURE;
+  xb=fftw_plan_many_dft(1,&nx,3*nyA*nzA,A,NULL,1,nx,A,NULL,1,nx,
+                        FFTW_BACKWARD,flags);
+  xf=fftw_plan_many_dft(1,&nx,6*nyA*nzA,A,NULL,1,nx,A,NULL,1,nx,
+                        FFTW_FORWARD,flags);
+  yb=fftw_plan_many_dft(1,&ny,3*nxB*nzA,B,NULL,1,ny,B,NULL,1,ny,
+                        FFTW_BACKWARD,flags);
+  yf=fftw_plan_many_dft(1,&ny,6*nxB*nzA,B,NULL,1,ny,B,NULL,1,ny,
+                        FFTW_FORWARD,flags);
+  zb=fftw_plan_many_dft_c2r(1,&nz,3*nxB*nyC,C,NULL,1,nzp,phys,NULL,1,nz,
+                            flags);
+  zf=fftw_plan_many_dft_r2c(1,&nz,6*nxB*nyC,phys,NULL,1,nz,C,NULL,1,nzp,
+                            flags);
+
+  init(u);
+
+  if(procrank == 0) ezvt.open("ezvt");
+
+  cout.precision(15);
+
+  for(int step=0; step < n; ++step) {
+    Output(step,true);
+    Source(u,S);
+#pragma omp parallel for
+    for(size_t m=0; m < nu3; ++m)
+      u[m] += S[m]*dt;
+    if(procrank == 0) cout << "[" << step << "] ";
+  }
+  if(procrank == 0) cout << endl;
+  Output(n,true);
+  Spectrum();
+
+  fftw_destroy_plan(zf);
+  fftw_destroy_plan(zb);
+  fftw_destroy_plan(yf);
+  fftw_destroy_plan(yb);
+  fftw_destroy_plan(xf);
+  fftw_destroy_plan(xb);
+  delete[] sendcounts;
+  fftw_free(recvbuf);
+  fftw_free(sendbuf);
+  fftw_free(phys);
+  fftw_free(bufC);
+  fftw_free(bufB);
+  fftw_free(bufA);
+  fftw_free(S);
+  fftw_free(u);
+
+  MPI_Type_free(&MPIComplex);
+  MPI_Finalize();
+  return 0;
+}